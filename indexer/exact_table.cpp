@@ -0,0 +1,236 @@
+#include "exact_table.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace fs = ::boost::filesystem;
+namespace ipc = ::boost::interprocess;
+
+using boost::string_ref;
+
+namespace {
+
+// The image starts with a header, the keys, the filter and the slots follow.
+// A key is stored as uint32_t size and its bytes, padded to 4. A slot holds
+// the upper half of the key's hash and its offset, which is 0 for empty
+// ones, slots are probed linearly from the lower half.
+
+static const uint32_t MAGIC = 0x54435845; // "EXCT"
+static const uint32_t VERSION = 1;
+
+struct header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t keys_count;
+    uint64_t filter_offset;
+    uint64_t filter_words;
+    uint64_t filter_hashes;
+    uint64_t slots_offset;
+    uint64_t slots_count;
+    uint64_t size;
+};
+
+struct slot
+{
+    uint32_t tag;
+    uint32_t offset;
+};
+
+inline size_t padded(size_t size)
+{
+    return (size + 3) & ~size_t(3);
+}
+
+inline uint64_t mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// Persisted, so it must not depend on the platform or the Boost version
+uint64_t key_hash(string_ref const& key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : key) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 0x100000001b3ULL;
+    }
+    return mix(h);
+}
+
+// Bits of the filter are picked by double hashing
+struct filter_probe
+{
+    filter_probe(uint64_t hash, uint64_t bits)
+    {
+        uint64_t h = mix(hash ^ 0x9e3779b97f4a7c15ULL);
+        a = static_cast<uint32_t>(h);
+        b = static_cast<uint32_t>(h >> 32) | 1;
+        mask = bits - 1;
+    }
+
+    uint64_t bit(uint64_t i) const
+    { return (a + i * b) & mask; }
+
+    uint64_t a, b, mask;
+};
+
+uint64_t power_of_two_above(uint64_t n)
+{
+    uint64_t result = 1;
+    while (result < n)
+        result <<= 1;
+    return result;
+}
+
+}
+
+template <>
+struct pimpl<exact_table>::implementation
+{
+    implementation(fs::path const& path)
+        : file(path.string().c_str(), ipc::read_only)
+        , region(file, ipc::read_only)
+    {
+        base = static_cast<char const*>(region.get_address());
+        h = reinterpret_cast<header const*>(base);
+        if (region.get_size() < sizeof(header) || h->magic != MAGIC ||
+                h->version != VERSION || h->size != region.get_size() ||
+                h->filter_offset + h->filter_words * sizeof(uint64_t) > h->size ||
+                h->slots_offset + h->slots_count * sizeof(slot) > h->size ||
+                h->slots_count == 0 || (h->slots_count & (h->slots_count - 1)) != 0 ||
+                h->filter_words == 0 || (h->filter_words & (h->filter_words - 1)) != 0)
+            throw std::logic_error("Invalid exact table " + path.string());
+        filter = reinterpret_cast<uint64_t const*>(base + h->filter_offset);
+        slots = reinterpret_cast<slot const*>(base + h->slots_offset);
+    }
+
+    ipc::file_mapping file;
+    ipc::mapped_region region;
+    char const* base;
+    header const* h;
+    uint64_t const* filter;
+    slot const* slots;
+};
+
+exact_table::exact_table(fs::path const& path)
+    : base(path)
+{
+}
+
+bool exact_table::contains(string_ref const& key) const
+{
+    implementation const& impl = **this;
+    uint64_t hash = key_hash(key);
+
+    filter_probe probe(hash, impl.h->filter_words * 64);
+    for (uint64_t i = 0; i < impl.h->filter_hashes; ++i) {
+        uint64_t bit = probe.bit(i);
+        if (!(impl.filter[bit / 64] & (uint64_t(1) << (bit % 64))))
+            return false;
+    }
+
+    uint64_t mask = impl.h->slots_count - 1;
+    uint32_t tag = static_cast<uint32_t>(hash >> 32);
+    for (uint64_t i = hash & mask; impl.slots[i].offset != 0; i = (i + 1) & mask) {
+        if (impl.slots[i].tag != tag)
+            continue;
+        char const* stored = impl.base + impl.slots[i].offset;
+        uint32_t size;
+        std::memcpy(&size, stored, sizeof(size));
+        if (string_ref(stored + sizeof(size), size) == key)
+            return true;
+    }
+    return false;
+}
+
+size_t exact_table::size() const
+{
+    return (*this)->h->keys_count;
+}
+
+void exact_table::write(fs::path const& path, trie::key_source_t const& keys)
+{
+    uint64_t count = 0;
+    keys([&count](string_ref const&) { ++count; });
+
+    // Half full slots and about 10 filter bits per key
+    header h = {};
+    h.magic = MAGIC;
+    h.version = VERSION;
+    h.keys_count = count;
+    h.slots_count = power_of_two_above(std::max<uint64_t>(2 * count, 16));
+    h.filter_words = power_of_two_above(std::max<uint64_t>(10 * count, 64)) / 64;
+    double bits_per_key = count ? double(h.filter_words * 64) / count : 1.;
+    h.filter_hashes = std::min<uint64_t>(std::max<uint64_t>(
+                std::lround(bits_per_key * std::log(2.)), 1), 16);
+
+    std::vector<slot> slots(h.slots_count, slot{ 0, 0 });
+    std::vector<uint64_t> filter(h.filter_words, 0);
+
+    fs::path tmp = path;
+    tmp += ".tmp";
+    fs::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    if (!file.good())
+        throw std::logic_error("Cannot write exact table " + tmp.string());
+    file.write(reinterpret_cast<char const*>(&h), sizeof(h));
+
+    uint64_t offset = sizeof(h);
+    uint64_t written = 0;
+    std::string record;
+    keys([&](string_ref const& key) {
+        if (++written > count)
+            throw std::logic_error("Keys changed while writing exact table");
+        record.assign(sizeof(uint32_t) + padded(key.size()), '\0');
+        if (offset + record.size() > std::numeric_limits<uint32_t>::max())
+            throw std::logic_error("Exact table does not fit 32-bit offsets");
+        uint32_t size = key.size();
+        std::memcpy(&record[0], &size, sizeof(size));
+        std::memcpy(&record[sizeof(size)], key.data(), key.size());
+
+        uint64_t hash = key_hash(key);
+        filter_probe probe(hash, h.filter_words * 64);
+        for (uint64_t i = 0; i < h.filter_hashes; ++i) {
+            uint64_t bit = probe.bit(i);
+            filter[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+        uint64_t mask = h.slots_count - 1;
+        uint64_t i = hash & mask;
+        while (slots[i].offset != 0)
+            i = (i + 1) & mask;
+        slots[i].tag = static_cast<uint32_t>(hash >> 32);
+        slots[i].offset = static_cast<uint32_t>(offset);
+
+        file.write(record.data(), record.size());
+        offset += record.size();
+    });
+    if (written != count)
+        throw std::logic_error("Keys changed while writing exact table");
+
+    // The filter is read as 64-bit words
+    static const char zeros[8] = {};
+    file.write(zeros, (8 - offset % 8) % 8);
+    h.filter_offset = (offset + 7) & ~uint64_t(7);
+    file.write(reinterpret_cast<char const*>(filter.data()), filter.size() * sizeof(uint64_t));
+    h.slots_offset = h.filter_offset + filter.size() * sizeof(uint64_t);
+    file.write(reinterpret_cast<char const*>(slots.data()), slots.size() * sizeof(slot));
+    h.size = h.slots_offset + slots.size() * sizeof(slot);
+    file.seekp(0);
+    file.write(reinterpret_cast<char const*>(&h), sizeof(h));
+    file.close();
+    if (!file.good())
+        throw std::logic_error("Cannot write exact table " + tmp.string());
+    fs::rename(tmp, path);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "pimpl/pimpl.h"
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "trie.hpp"
+
+// Memory-mapped read-only hash table of all keys of a frozen index, with a
+// Bloom filter in front of it, so that exact lookups take a few probes and
+// most misses don't touch the table at all
+struct exact_table
+    : private pimpl<exact_table>::pointer_semantics
+    , public boost::noncopyable
+{
+    exact_table(boost::filesystem::path const& path);
+
+    bool contains(boost::string_ref const& key) const;
+    size_t size() const;
+
+    // Writes a table of the keys of the source, which is read twice.
+    // Keys have to be unique.
+    static void write(boost::filesystem::path const& path, trie::key_source_t const& keys);
+};
@@ -21,6 +21,8 @@ namespace rpc_error {
     static const int INVALID_STORE = 2;
     static const int STORE_NOT_FOUND = 3;
     static const int OPERATION_NOT_SUPPORTED = 4;
+    static const int SERVER_BUSY = 5;
+    static const int INVALID_ARGUMENT = 6;
 }
 
 #define RPC_REPORT_EXCEPTIONS(reply) \
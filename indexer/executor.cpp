@@ -0,0 +1,168 @@
+#include "executor.hpp"
+
+#include <deque>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+
+template <>
+struct pimpl<indexer::executor>::implementation
+{
+    typedef indexer::executor::task_t task_t;
+
+    implementation(size_t threads)
+        : stopping(false)
+    {
+        for (size_t i = 0; i < threads; ++i)
+            workers.create_thread([this] { work(); });
+    }
+
+    ~implementation()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        workers.join_all();
+    }
+
+    void work()
+    {
+        for (;;) {
+            task_t task;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty() && !stopping)
+                    ready.wait(lock);
+                if (queue.empty())
+                    return;
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+
+    bool try_pop(task_t& task)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (queue.empty())
+            return false;
+        task = std::move(queue.front());
+        queue.pop_front();
+        return true;
+    }
+
+    std::deque<task_t> queue;
+    bool stopping;
+    boost::mutex mutex;
+    boost::condition_variable ready;
+    boost::thread_group workers;
+};
+
+namespace indexer {
+
+executor::executor(size_t threads)
+    : base(threads)
+{
+}
+
+executor::~executor()
+{
+}
+
+size_t executor::size() const
+{
+    return (*this)->workers.size();
+}
+
+void executor::submit(task_t const& task)
+{
+    implementation& impl = **this;
+    {
+        boost::lock_guard<boost::mutex> lock(impl.mutex);
+        impl.queue.push_back(task);
+    }
+    impl.ready.notify_one();
+}
+
+bool executor::run_one()
+{
+    task_t task;
+    if (!(*this)->try_pop(task))
+        return false;
+    task();
+    return true;
+}
+
+task_group::task_group(executor* exec)
+    : exec_(exec), pending_(0)
+{
+}
+
+task_group::~task_group()
+{
+    // Queued tasks reference the group
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (pending_ != 0)
+        done_.wait(lock);
+}
+
+void task_group::run(executor::task_t const& task)
+{
+    if (!exec_) {
+        try {
+            task();
+        } catch (...) {
+            finish(boost::current_exception());
+        }
+        return;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        ++pending_;
+    }
+    exec_->submit([this, task] {
+        boost::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = boost::current_exception();
+        }
+        finish(error);
+    });
+}
+
+void task_group::finish(boost::exception_ptr const& error)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (error && !error_)
+        error_ = error;
+    if (exec_ && --pending_ == 0)
+        done_.notify_all();
+}
+
+void task_group::wait()
+{
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (pending_ != 0) {
+        lock.unlock();
+        // Once the queue is drained every task of the group is already
+        // running somewhere, queued tasks of other groups are still progress
+        bool ran = exec_->run_one();
+        lock.lock();
+        if (!ran) {
+            while (pending_ != 0)
+                done_.wait(lock);
+        }
+    }
+
+    boost::exception_ptr error = error_;
+    error_ = boost::exception_ptr();
+    lock.unlock();
+    if (error)
+        boost::rethrow_exception(error);
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "pimpl/pimpl.h"
+#include <boost/noncopyable.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <functional>
+
+namespace indexer {
+
+// Fixed-size thread pool
+struct executor
+    : private pimpl<executor>::pointer_semantics
+    , public boost::noncopyable
+{
+    typedef std::function<void()> task_t;
+
+    executor(size_t threads);
+    ~executor();
+
+    size_t size() const;
+
+    void submit(task_t const& task);
+
+    // Runs a queued task on the calling thread, returns false if the queue is empty
+    bool run_one();
+};
+
+// Set of tasks waited for together. Without an executor tasks run inline.
+struct task_group
+    : public boost::noncopyable
+{
+    task_group(executor* exec);
+    ~task_group();
+
+    void run(executor::task_t const& task);
+
+    // Helps running queued tasks until the group is done, so it is safe
+    // to call from a worker. Rethrows the first exception of the group.
+    void wait();
+
+private:
+    void finish(boost::exception_ptr const& error);
+
+    executor* exec_;
+    size_t pending_;
+    boost::exception_ptr error_;
+    boost::mutex mutex_;
+    boost::condition_variable done_;
+};
+
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <boost/array.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/optional.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+
+// Bit-parallel variant of fuzzy_processor for short patterns.
+// Rows are kept in Words machine words, so feeding a character
+// never touches the heap and a context is a plain value.
+
+template <size_t Words>
+struct bit_row
+{
+    typedef uint64_t block_t;
+    static const size_t block_bits = std::numeric_limits<block_t>::digits;
+
+    bit_row()
+    { clear(); }
+
+    void clear()
+    { std::fill(blocks, blocks + Words, block_t(0)); }
+
+    bool test(size_t i) const
+    { return (blocks[i / block_bits] >> (i % block_bits)) & 1; }
+
+    void set(size_t i)
+    { blocks[i / block_bits] |= block_t(1) << (i % block_bits); }
+
+    bool none() const
+    {
+        block_t acc = 0;
+        for (size_t i = 0; i < Words; ++i)
+            acc |= blocks[i];
+        return acc == 0;
+    }
+
+    bit_row& operator<<=(size_t shift)
+    {
+        assert(shift > 0 && shift < block_bits);
+        for (size_t i = Words - 1; i > 0; --i)
+            blocks[i] = (blocks[i] << shift) | (blocks[i - 1] >> (block_bits - shift));
+        blocks[0] <<= shift;
+        return *this;
+    }
+
+    bit_row& operator|=(bit_row const& other)
+    {
+        for (size_t i = 0; i < Words; ++i)
+            blocks[i] |= other.blocks[i];
+        return *this;
+    }
+
+    bit_row& operator&=(bit_row const& other)
+    {
+        for (size_t i = 0; i < Words; ++i)
+            blocks[i] &= other.blocks[i];
+        return *this;
+    }
+
+    bit_row operator<<(size_t shift) const
+    { bit_row r(*this); return r <<= shift; }
+
+    bit_row operator|(bit_row const& other) const
+    { bit_row r(*this); return r |= other; }
+
+    bit_row operator&(bit_row const& other) const
+    { bit_row r(*this); return r &= other; }
+
+    block_t blocks[Words];
+};
+
+template <size_t Words>
+struct fixed_fuzzy_processor
+{
+    typedef bit_row<Words> row_t;
+
+    static const size_t max_pattern_size = Words * row_t::block_bits;
+    static const size_t max_corrections_limit = 7;
+
+    static bool supports(size_t pattern_size, size_t k)
+    { return pattern_size <= max_pattern_size && k <= max_corrections_limit; }
+
+    struct context {
+        friend struct fixed_fuzzy_processor;
+        context(fixed_fuzzy_processor const& processor)
+            : position(0), cnt(0), cntp(0), SMapP(&processor.S[0])
+        {
+            std::copy(processor.Ri, processor.Ri + processor.k + 1, R);
+        }
+
+    private:
+        row_t R[max_corrections_limit + 1], Rp[max_corrections_limit + 1];
+        size_t position;
+        size_t cnt, cntp;
+        row_t const* SMapP;
+    };
+
+    fixed_fuzzy_processor(boost::string_ref const& pattern, size_t k, bool has_transpositions)
+        : k(k), m(pattern.size()), has_transp(has_transpositions)
+    {
+        assert(!pattern.empty());
+        assert(supports(m, k));
+        // S[0] is kept empty for the unknown characters
+        for (size_t i = 0, cnt = 0; i < m; ++i)
+        {
+            unsigned char& idx = Map[static_cast<unsigned char>(pattern[i])];
+            if (!idx) {
+                idx = ++cnt;
+            }
+            S[idx].set(i);
+        }
+
+        for (size_t i = 0; i < m; ++i)
+            mask.set(i);
+
+        for (size_t i = 0; i <= k; ++i)
+            for (size_t j = 0; j < std::min(i, m); ++j)
+                Ri[i].set(j);
+    }
+
+    size_t max_corrections() const
+    { return k; }
+
+    size_t pattern_size() const
+    { return m; }
+
+    bool has_transpositions() const
+    { return has_transp; }
+
+    // Contexts are plain values here, see fuzzy_processor::fork
+    context fork(context const& parent) const
+    { return parent; }
+
+    bool check(boost::string_ref const& t, bool final, size_t* dist = nullptr,
+            context* ctx = nullptr) const
+    {
+        boost::optional<context> new_ctx;
+        if (ctx == nullptr)
+            new_ctx = boost::in_place(*this);
+        context& ctx_ref = ctx == nullptr ? *new_ctx : *ctx;
+
+        for (; ctx_ref.position < t.size(); ++ctx_ref.position)
+            do_feed(t[ctx_ref.position], ctx_ref);
+
+        if (final) {
+            if (!ctx_ref.R[k].test(m - 1))
+                return false;
+            if (dist)
+                *dist = distance(ctx_ref);
+            return true;
+        }
+        return alive(ctx_ref);
+    }
+
+    void feed(char c, context& ctx) const
+    {
+        do_feed(c, ctx);
+        ++ctx.position;
+    }
+
+    void feed(boost::string_ref const& t, context& ctx) const
+    {
+        feed(t[ctx.position], ctx);
+    }
+
+    // No text starting with the one fed to ctx is closer to the pattern,
+    // rows below it are empty and stay so
+    size_t min_distance(context const& ctx) const
+    {
+        return has_transp ? std::min(ctx.cnt, ctx.cntp + 1) : ctx.cnt;
+    }
+
+    bool query(context& ctx, bool& is_final, size_t* dist = nullptr) const
+    {
+        if (ctx.R[k].test(m - 1)) {
+            if (dist)
+                *dist = distance(ctx);
+            is_final = true;
+        }
+        return alive(ctx);
+    }
+
+private:
+    bool alive(context const& ctx) const
+    {
+        if (has_transp)
+            return ctx.cnt <= k || ctx.cntp < k;
+        else
+            return ctx.cnt <= k;
+    }
+
+    size_t distance(context const& ctx) const
+    {
+        size_t x;
+        for (x = k; ctx.R[x].test(m - 1) && x --> 0;);
+        return x + 1;
+    }
+
+    void do_feed(char c, context& ctx) const
+    {
+        row_t R1[max_corrections_limit + 1];
+        size_t cnt1 = ctx.cnt;
+        row_t const& SMap = S[Map[static_cast<unsigned char>(c)]];
+        const size_t j = ctx.position;
+
+        for (size_t d = ctx.cnt; d <= k; ++d) {
+            R1[d] = ctx.R[d] << 1;
+            if (j <= d)
+                R1[d].set(0);
+            R1[d] &= SMap;
+            if (d > ctx.cnt) {
+                row_t temp = (ctx.R[d - 1] | R1[d - 1]) << 1;
+                temp |= ctx.R[d - 1];
+                if (j <= d - 1)
+                    temp.set(0);
+                // Keep bits past the pattern end clear, dynamic_bitset drops them
+                temp &= mask;
+                R1[d] |= temp;
+            }
+        }
+        if (has_transp && j > 0) {
+            size_t d0 = std::max<size_t>(ctx.cntp + 1, 1);
+            row_t const SMapShifted = SMap << 1;
+            for (size_t d = d0; d <= k; ++d) {
+                row_t temp = ctx.Rp[d - 1] << 2;
+                if (j <= d && m > 1)
+                    temp.set(1);
+                temp &= *ctx.SMapP;
+                temp &= SMapShifted;
+                R1[d] |= temp;
+            }
+        }
+        for (size_t d = ctx.cnt; d <= k; ++d) {
+            if (d == cnt1 && j >= d && R1[d].none()) {
+                cnt1 = d + 1;
+            }
+        }
+
+        if (has_transp) {
+            std::copy(ctx.R, ctx.R + k + 1, ctx.Rp);
+        }
+        std::copy(R1, R1 + k + 1, ctx.R);
+        ctx.SMapP = &SMap;
+
+        ctx.cntp = ctx.cnt;
+        ctx.cnt = cnt1;
+    }
+
+    row_t Ri[max_corrections_limit + 1];
+
+    boost::array<row_t, max_pattern_size + 1> S;
+
+    boost::array<unsigned char,
+        1 << std::numeric_limits<unsigned char>::digits> Map = {};
+
+    row_t mask;
+
+    size_t k;
+    size_t m;
+
+    bool has_transp;
+};
@@ -0,0 +1,170 @@
+#include "frozen_trie.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "frozen_trie_layout.hpp"
+#include "trie_search.hpp"
+
+namespace fs = ::boost::filesystem;
+namespace ipc = ::boost::interprocess;
+
+using boost::string_ref;
+
+template <>
+struct pimpl<frozen_trie>::implementation
+{
+    implementation(fs::path const& path)
+        : file(path.string().c_str(), ipc::read_only)
+        , region(file, ipc::read_only)
+    {
+        base = static_cast<char const*>(region.get_address());
+        frozen::header const* h = reinterpret_cast<frozen::header const*>(base);
+        if (region.get_size() < sizeof(frozen::header) ||
+                h->magic != frozen::MAGIC || h->version != frozen::VERSION ||
+                h->size != region.get_size() || h->root >= h->size)
+            throw std::logic_error("Invalid frozen trie image " + path.string());
+        root = reinterpret_cast<frozen::node const*>(base + h->root);
+    }
+
+    ipc::file_mapping file;
+    ipc::mapped_region region;
+    char const* base;
+    frozen::node const* root;
+};
+
+namespace {
+
+struct frozen_tree
+{
+    typedef frozen::node const* node_ref;
+    typedef frozen::edge child;
+
+    frozen_tree(pimpl<frozen_trie>::implementation const& impl)
+        : base(impl.base), root_(impl.root)
+    {}
+
+    node_ref root() const
+    { return root_; }
+
+    boost::iterator_range<child const*> children(node_ref node) const
+    { return boost::make_iterator_range(node->edges(), node->edges() + node->children_count); }
+
+    string_ref label(child const& edge) const
+    { return string_ref(base + edge.label, edge.size); }
+
+    bool is_leaf(child const& edge) const
+    { return edge.target == 0; }
+
+    node_ref resolve(node_ref, child const& edge) const
+    { return reinterpret_cast<node_ref>(base + edge.target); }
+
+    child const* find_child(node_ref node, char c) const
+    {
+        // Siblings never share the first byte
+        void const* pos = std::memchr(node->first_bytes(), c, node->children_count);
+        if (!pos)
+            return nullptr;
+        return node->edges() + (static_cast<char const*>(pos) - node->first_bytes());
+    }
+
+    // Edges never move in the image
+    leaf_id leaf(node_ref, child const& edge) const
+    { return reinterpret_cast<char const*>(&edge) - base; }
+
+    uint32_t weight(child const& edge) const
+    { return edge.weight; }
+
+private:
+    char const* base;
+    node_ref root_;
+};
+
+}
+
+frozen_trie::frozen_trie(fs::path const& path)
+    : base(path)
+{
+}
+
+void frozen_trie::search_exact(string_ref const& data, results_t& results)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree>(tree).search_exact(data, results);
+}
+
+bool frozen_trie::search(string_ref const& data, size_t k, bool has_transp, results_t& results,
+        size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search(data, k, has_transp, results);
+    return searcher.truncated();
+}
+
+bool frozen_trie::search_split(string_ref const& data, size_t switch_len,
+        size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+        bool has_transp, results_t& results, size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search_split(data, switch_len,
+            k1, exact_dist1, k2, exact_dist2, has_transp, results);
+    return searcher.truncated();
+}
+
+void frozen_trie::search_exact(string_ref const& data, leaf_visitor_t const& visitor)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree>(tree).search_exact(data, visitor);
+}
+
+bool frozen_trie::search(string_ref const& data, size_t k, bool has_transp,
+        leaf_visitor_t const& visitor, size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search(data, k, has_transp, visitor);
+    return searcher.truncated();
+}
+
+bool frozen_trie::search_split(string_ref const& data, size_t switch_len,
+        size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+        bool has_transp, leaf_visitor_t const& visitor, size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search_split(data, switch_len,
+            k1, exact_dist1, k2, exact_dist2, has_transp, visitor);
+    return searcher.truncated();
+}
+
+bool frozen_trie::search_prefix(string_ref const& prefix, leaf_visitor_t const& visitor,
+        size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search_prefix(prefix, visitor);
+    return searcher.truncated();
+}
+
+bool frozen_trie::search_closest(string_ref const& data, size_t k, bool has_transp,
+        ranked_visitor_t const& visitor, size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search_closest(data, k, has_transp, visitor);
+    return searcher.truncated();
+}
+
+bool frozen_trie::search_top(string_ref const& prefix, weighted_visitor_t const& visitor,
+        size_t limit)
+{
+    frozen_tree tree(**this);
+    trie_searcher<frozen_tree> searcher(tree, limit);
+    searcher.search_top(prefix, visitor);
+    return searcher.truncated();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "pimpl/pimpl.h"
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <vector>
+#include <limits>
+
+#include "trie_leaf.hpp"
+
+// Memory-mapped read-only trie image, see trie::freeze
+struct frozen_trie
+    : private pimpl<frozen_trie>::pointer_semantics
+    , public boost::noncopyable
+{
+    frozen_trie(boost::filesystem::path const& path);
+
+    typedef std::vector<std::string> results_t;
+
+    // Stop after limit results and return whether they were cut
+    bool search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results,
+            size_t limit = std::numeric_limits<size_t>::max());
+    bool search_split(boost::string_ref const& data, size_t switch_len,
+            size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+            bool has_transp, results_t& results,
+            size_t limit = std::numeric_limits<size_t>::max());
+    void search_exact(boost::string_ref const& data, results_t& results);
+
+    // Same searches reporting leaves to a visitor, keys are not copied
+    bool search(boost::string_ref const& data, size_t k, bool has_transp,
+            leaf_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+    bool search_split(boost::string_ref const& data, size_t switch_len,
+            size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+            bool has_transp, leaf_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+    void search_exact(boost::string_ref const& data, leaf_visitor_t const& visitor);
+    bool search_prefix(boost::string_ref const& prefix, leaf_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+    bool search_closest(boost::string_ref const& data, size_t k, bool has_transp,
+            ranked_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+
+    // Reports up to limit keys starting with prefix, heaviest first, see
+    // trie::freeze. Only subtrees that can still beat them are walked.
+    bool search_top(boost::string_ref const& prefix, weighted_visitor_t const& visitor,
+            size_t limit);
+};
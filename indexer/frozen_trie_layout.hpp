@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Read-only trie image produced by trie::freeze.
+//
+// The image starts with a header, nodes follow in post-order, so every
+// subtree occupies a contiguous range and the root is written last.
+// A node record is laid out as
+//     uint32_t children_count;
+//     char first_bytes[children_count];   // padded to 4 bytes
+//     edge edges[children_count];
+//     char labels[];                      // padded to 4 bytes
+// All offsets are counted from the start of the image.
+
+namespace frozen {
+
+static const uint32_t MAGIC = 0x54525a46; // "FZRT"
+static const uint32_t VERSION = 2;
+
+inline size_t padded(size_t size)
+{
+    return (size + 3) & ~size_t(3);
+}
+
+struct header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t root;
+    uint32_t nodes_count;
+    uint64_t size;
+};
+
+struct edge
+{
+    // Offset of the child node, 0 for leaves
+    uint32_t target;
+    uint32_t label;
+    uint32_t size;
+    // Weight of the key for leaves, the largest one below for inner edges
+    uint32_t weight;
+};
+
+struct node
+{
+    uint32_t children_count;
+
+    char const* first_bytes() const
+    { return reinterpret_cast<char const*>(this + 1); }
+
+    edge const* edges() const
+    { return reinterpret_cast<edge const*>(first_bytes() + padded(children_count)); }
+};
+
+}
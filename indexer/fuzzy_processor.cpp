@@ -1,153 +1,216 @@
 #include "fuzzy_processor.hpp"
 
-#include <boost/optional.hpp>
-#include <limits>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+typedef fuzzy_processor::block_t block_t;
+
+static const size_t block_bits = std::numeric_limits<block_t>::digits;
+
+namespace {
+
+void set_bit(block_t* r, size_t i)
+{
+    r[i / block_bits] |= block_t(1) << (i % block_bits);
+}
+
+// dst = (src << shift) & top_mask, like dynamic_bitset drops the bits past the end
+void shift_left(block_t* dst, block_t const* src, size_t shift, size_t n, block_t top_mask)
+{
+    for (size_t i = n - 1; i > 0; --i)
+        dst[i] = (src[i] << shift) | (src[i - 1] >> (block_bits - shift));
+    dst[0] = src[0] << shift;
+    dst[n - 1] &= top_mask;
+}
+
+void or_assign(block_t* dst, block_t const* src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] |= src[i];
+}
+
+void and_assign(block_t* dst, block_t const* src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] &= src[i];
+}
+
+bool none(block_t const* r, size_t n)
+{
+    block_t acc = 0;
+    for (size_t i = 0; i < n; ++i)
+        acc |= r[i];
+    return acc == 0;
+}
+
+}
 
 fuzzy_processor::fuzzy_processor(boost::string_ref const& pattern, size_t k,
         bool has_transpositions)
     : Map({}), k(k), m(pattern.size()), has_transp(has_transpositions)
 {
     assert(!pattern.empty());
-    S.assign(m + 1, pattern_mask_t(m));
+    blocks = (m + block_bits - 1) / block_bits;
+    frame = 2 * (k + 1) * blocks;
+    top_mask = m % block_bits ? (block_t(1) << (m % block_bits)) - 1 : ~block_t(0);
+
+    S.assign((m + 1) * blocks, 0);
     for (size_t i = 0, cnt = 0; i < m; ++i)
     {
         size_t& idx = Map[static_cast<unsigned char>(pattern[i])];
         if (!idx) {
             idx = ++cnt;
         }
-        S[idx][i] = 1;
+        set_bit(&S[idx * blocks], i);
     }
+    S1.resize(S.size());
+    for (size_t i = 0; i <= m; ++i)
+        shift_left(&S1[i * blocks], &S[i * blocks], 1, blocks, top_mask);
 
-    Ri.assign(k + 1, pattern_mask_t(m));
+    Ri.assign((k + 1) * blocks, 0);
 
     for (size_t i = 0; i <= k; ++i)
-        for (size_t j = 0; j < i; ++j)
-            Ri[i][j] = 1;
+        for (size_t j = 0; j < std::min(i, m); ++j)
+            set_bit(&Ri[i * blocks], j);
+
+    // Room for a few levels upfront, fork() extends it on deeper walks
+    arena.resize(8 * frame);
+    // R1 rows plus one temporary row
+    scratch.resize((k + 2) * blocks);
 }
 
 fuzzy_processor::context::context(fuzzy_processor const& processor)
 {
-    cnt = cntp = position = 0;
-    R = processor.Ri;
+    depth = cnt = cntp = position = 0;
+    std::copy(processor.Ri.begin(), processor.Ri.end(), processor.row(*this, 0));
+    std::fill_n(processor.prev_row(*this, 0), processor.Ri.size(), 0);
     SMapP = &processor.S[0];
 }
 
-bool fuzzy_processor::check(boost::string_ref const& t, bool final, size_t* dist, 
+fuzzy_processor::context fuzzy_processor::fork(context const& parent) const
+{
+    context result(parent);
+    ++result.depth;
+    if (arena.size() < (result.depth + 1) * frame)
+        arena.resize(2 * (result.depth + 1) * frame);
+    std::memcpy(row(result, 0), row(parent, 0), frame * sizeof(block_t));
+    return result;
+}
+
+bool fuzzy_processor::check(boost::string_ref const& t, bool final, size_t* dist,
         context* ctx) const
 {
-    row_t R1;
-    R1.assign(k + 1, pattern_mask_t(m));
-    size_t cnt1;
-
-    boost::optional<context> new_ctx;
-    if (ctx == nullptr)
-        new_ctx = boost::in_place(*this);
-    context& ctx_ref = ctx == nullptr ? *new_ctx : *ctx;
-
-    size_t& j = ctx_ref.position;
-    for (; j < t.size(); ++j) {
-        do_feed(R1, cnt1, t[j], ctx_ref);
+    context new_ctx;
+    if (ctx == nullptr) {
+        new_ctx = context(*this);
+        ctx = &new_ctx;
+    }
+
+    for (; ctx->position < t.size(); ++ctx->position) {
+        do_feed(t[ctx->position], *ctx);
     }
 
     if (final) {
-        if (!ctx_ref.R[k].test(m - 1))
+        if (!test_last(row(*ctx, k)))
             return false;
-        if (dist) {
-            size_t x;
-            for (x = k; ctx_ref.R[x].test(m - 1) && x --> 0;);
-            *dist = x + 1;
-        }
+        if (dist)
+            *dist = distance(*ctx);
         return true;
-    } else {
-        if (has_transp)
-            return ctx_ref.cnt <= k || ctx_ref.cntp < k;
-        else
-            return ctx_ref.cnt <= k;
     }
+    return alive(*ctx);
 }
 
 void fuzzy_processor::feed(char c, context& ctx) const
 {
-    row_t R1;
-    R1.assign(k + 1, pattern_mask_t(m));
-    size_t cnt1;
-
-    do_feed(R1, cnt1, c, ctx);
+    do_feed(c, ctx);
     ++ctx.position;
 }
 
 bool fuzzy_processor::query(context& ctx, bool& is_final, size_t* dist) const
 {
-    if (ctx.R[k].test(m - 1)) {
-        if (dist) {
-            size_t x;
-            for (x = k; ctx.R[x].test(m - 1) && x --> 0;);
-            *dist = x + 1;
-        }
+    if (test_last(row(ctx, k))) {
+        if (dist)
+            *dist = distance(ctx);
         is_final = true;
     }
+    return alive(ctx);
+}
+
+bool fuzzy_processor::test_last(block_t const* r) const
+{
+    return (r[(m - 1) / block_bits] >> ((m - 1) % block_bits)) & 1;
+}
+
+size_t fuzzy_processor::distance(context const& ctx) const
+{
+    size_t x;
+    for (x = k; test_last(row(ctx, x)) && x --> 0;);
+    return x + 1;
+}
+
+bool fuzzy_processor::alive(context const& ctx) const
+{
     if (has_transp)
         return ctx.cnt <= k || ctx.cntp < k;
     else
         return ctx.cnt <= k;
 }
 
-bool fuzzy_processor::do_feed(row_t& R1, size_t& cnt1, char c, context& ctx) const
+void fuzzy_processor::do_feed(char c, context& ctx) const
 {
-    cnt1 = ctx.cnt;
-    pattern_mask_t const& SMap = this->S[Map[static_cast<unsigned char>(c)]];
+    size_t cnt1 = ctx.cnt;
+    size_t idx = Map[static_cast<unsigned char>(c)];
+    block_t const* SMap = &S[idx * blocks];
+    block_t const* SMap1 = &S1[idx * blocks];
     const size_t j = ctx.position;
 
-    // Allocation here
-    pattern_mask_t temp(m);
+    block_t* R1 = &scratch[0];
+    block_t* temp = &scratch[(k + 1) * blocks];
+    std::fill_n(R1, (k + 1) * blocks, 0);
 
     for (size_t d = ctx.cnt; d <= k; ++d) {
+        block_t* R1d = R1 + d * blocks;
         // R1[d] = (((R[d] << 1) | (j <= d)) & SMap);
-        temp = ctx.R[d];
-        temp <<= 1;
+        shift_left(R1d, row(ctx, d), 1, blocks, top_mask);
         if (j <= d)
-            temp.set(0);
-        temp &= SMap;
-        R1[d] = temp;
-        // end
+            R1d[0] |= 1;
+        and_assign(R1d, SMap, blocks);
         if (d > ctx.cnt) {
             // R1[d] |= ((R[d - 1] | R1[d - 1]) << 1) | R[d - 1] | (j <= d - 1);
-            temp = ctx.R[d - 1];
-            temp |= R1[d - 1];
-            temp <<= 1;
-            temp |= ctx.R[d - 1];
+            block_t const* Rd1 = row(ctx, d - 1);
+            std::copy(Rd1, Rd1 + blocks, temp);
+            or_assign(temp, R1d - blocks, blocks);
+            shift_left(temp, temp, 1, blocks, top_mask);
+            or_assign(temp, Rd1, blocks);
             if (j <= d - 1)
-                temp.set(0);
-            R1[d] |= temp;
-            // end
+                temp[0] |= 1;
+            or_assign(R1d, temp, blocks);
         }
     }
     if (has_transp && j > 0) {
         size_t d0 = std::max<size_t>(ctx.cntp + 1, 1);
         for (size_t d = d0; d <= k; ++d) {
             // R1[d] |= (RP[d - 1] << 2 | (Uint(j <= d) << 1)) & SMapP & (SMap << 1);
-            temp = ctx.Rp[d - 1];
-            temp <<= 2;
+            shift_left(temp, prev_row(ctx, d - 1), 2, blocks, top_mask);
             if (j <= d && m > 1)
-                temp.set(1);
-            temp &= *ctx.SMapP;
-            // Alloc here :(
-            temp &= SMap << 1;
-            R1[d] |= temp;
-            // end
+                temp[0] |= 2;
+            and_assign(temp, ctx.SMapP, blocks);
+            and_assign(temp, SMap1, blocks);
+            or_assign(R1 + d * blocks, temp, blocks);
         }
     }
     for (size_t d = ctx.cnt; d <= k; ++d) {
-        if (d == cnt1 && j >= d && R1[d].none()) {
+        if (d == cnt1 && j >= d && none(R1 + d * blocks, blocks)) {
             cnt1 = d + 1;
         }
     }
 
     if (has_transp) {
-        ctx.Rp = ctx.R;
+        std::copy(row(ctx, 0), row(ctx, k + 1), prev_row(ctx, 0));
     }
-    ctx.R = R1;
-    ctx.SMapP = &SMap;
+    std::copy(R1, R1 + (k + 1) * blocks, row(ctx, 0));
+    ctx.SMapP = SMap;
 
     ctx.cntp = ctx.cnt;
     ctx.cnt = cnt1;
@@ -1,30 +1,34 @@
 #pragma once
 
-#include <boost/dynamic_bitset.hpp>
 #include <boost/array.hpp>
 #include <boost/utility/string_ref.hpp>
+#include <limits>
 #include <vector>
 
 // Fast Damerau–Levenshtein (restricted) distance check
 // algorithm based on work of Leonid Boitsov
 
+// Rows of all contexts live in one flat arena owned by the processor,
+// one frame per trie depth.  A child context is made with fork(), which
+// copies the parent frame into the next depth slot, so siblings reuse
+// the same slot and nothing is allocated once the arena is warm.
+// Consequently a processor serves one walk at a time and only one
+// context per depth may be in use.
+
 struct fuzzy_processor {
-    // TODO: use a custom pool allocator here
-    typedef boost::dynamic_bitset<size_t> pattern_mask_t;
-    typedef std::vector<pattern_mask_t> row_t;
+    typedef size_t block_t;
 
     struct context {
         friend class fuzzy_processor;
         context(fuzzy_processor const& processor);
-        context(context&&) = default;
-        context(context const&) = default;
-        ~context() = default;
 
     private:
-        row_t R, Rp;
+        context() = default;
+
+        size_t depth;
         size_t position;
         size_t cnt, cntp;
-        pattern_mask_t const* SMapP;
+        block_t const* SMapP;
     };
 
     fuzzy_processor(boost::string_ref const& pattern, size_t k, bool has_transpositions);
@@ -38,7 +42,9 @@ struct fuzzy_processor {
     bool has_transpositions() const
     { return has_transp; }
 
-    bool check(boost::string_ref const& t, bool final, size_t* dist = nullptr, 
+    context fork(context const& parent) const;
+
+    bool check(boost::string_ref const& t, bool final, size_t* dist = nullptr,
             context* ctx = nullptr) const;
     void feed(char c, context& ctx) const;
 
@@ -51,18 +57,35 @@ struct fuzzy_processor {
 private:
     friend class context;
 
-    bool do_feed(row_t& R1, size_t& cnt1, char c, context& ctx) const;
+    void do_feed(char c, context& ctx) const;
+
+    block_t* row(context const& ctx, size_t d) const
+    { return &arena[ctx.depth * frame + d * blocks]; }
+
+    block_t* prev_row(context const& ctx, size_t d) const
+    { return row(ctx, k + 1 + d); }
 
-    row_t Ri;
+    bool test_last(block_t const* r) const;
+    size_t distance(context const& ctx) const;
+    bool alive(context const& ctx) const;
 
-    std::vector<pattern_mask_t> S;
+    std::vector<block_t> Ri;
 
-    boost::array<pattern_mask_t::size_type, 
+    // S and S shifted by one, (m + 1) rows each
+    std::vector<block_t> S, S1;
+
+    boost::array<size_t,
         1 << std::numeric_limits<unsigned char>::digits> Map;
 
+    mutable std::vector<block_t> arena;
+    mutable std::vector<block_t> scratch;
+
     size_t k;
     size_t m;
 
+    size_t blocks;
+    size_t frame;
+    block_t top_mask;
+
     bool has_transp;
 };
-
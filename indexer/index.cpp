@@ -1,111 +1,740 @@
 #include "index.hpp"
 
 #include <memory>
+#include <deque>
+#include <atomic>
 #include <boost/format.hpp>
 #include <boost/range/algorithm.hpp>
-#include <boost/range/algorithm_ext.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/lock_types.hpp>
 
 #include "trie.hpp"
+#include "frozen_trie.hpp"
+#include "exact_table.hpp"
+#include "executor.hpp"
+#include "metrics.hpp"
+#include "stagedb.hpp"
 #include "exceptions.hpp"
 
 namespace fs = boost::filesystem;
 
 static const std::string EOS = "\xFF";
 
+namespace {
+
+struct string_ref_hash
+{
+    size_t operator()(boost::string_ref const& s) const
+    { return boost::hash_range(s.begin(), s.end()); }
+};
+
+// Collects the keys a walk reports until limit distinct ones are found.
+// Split walks can report a leaf more than once, it is recognized by its ID
+// before its key is copied. Counting distinct keys keeps the keys of a
+// limited walk the first ones of an unlimited walk.
+struct walk_collector
+{
+    walk_collector(std::vector<std::string>& out, size_t limit, bool reversed)
+        : out(out), limit(limit), reversed(reversed)
+    {}
+
+    bool operator()(leaf_id leaf, boost::string_ref const& key)
+    {
+        if (!seen.insert(leaf).second)
+            return true;
+        if (reversed)
+            out.emplace_back(key.rbegin(), key.rend());
+        else
+            out.emplace_back(key.begin(), key.end());
+        // Stops the walk
+        return out.size() < limit;
+    }
+
+    std::vector<std::string>& out;
+    size_t limit;
+    bool reversed;
+    boost::unordered_set<leaf_id> seen;
+};
+
+// Frozen images of both tries, the forward one with its exact table
+struct frozen_images
+{
+    std::unique_ptr<frozen_trie> forward;
+    std::unique_ptr<frozen_trie> reverse;
+    std::unique_ptr<exact_table> exact;
+};
+typedef boost::shared_ptr<frozen_images> images_ptr;
+
+// Images searches read, the base ones first and then those published since,
+// oldest first. Never changed once published, a search keeps the one it
+// started with alive until it is done.
+struct snapshot
+{
+    std::vector<images_ptr> images;
+};
+typedef boost::shared_ptr<snapshot const> snapshot_ptr;
+
+// Keys published since the base images were frozen
+struct delta
+{
+    std::vector<std::string> keys;
+    images_ptr images;
+};
+
+// Deltas are refrozen with the tries once they hold more keys than this
+// or than a share of the base
+static const size_t MIN_DELTA_KEYS = 1 << 16;
+static const size_t DELTA_RATIO = 8;
+
+}
+
 template <>
 struct pimpl<indexer::index>::implementation
 {
-    implementation(fs::path const& path)
-        : forward(path / "fwd"), reverse(path / "rev")
-    {}
+    implementation(fs::path const& path, indexer::index::options_t const& options)
+        : path(path)
+        , forward(path / "fwd", options.trie)
+        , reverse(path / "rev", options.trie)
+        , executor(options.search_executor)
+        , build_executor(options.build_executor)
+        , bulk_build(options.bulk_build)
+        , snapshots(options.snapshots)
+        , weight(options.weight)
+        , staged_count(0)
+        , saved(false)
+        , delta_keys(0)
+    {
+        // Deltas are small, their scratch tries don't need big parts
+        delta_options = options.trie;
+        delta_options.part_initial_size = std::min<size_t>(
+                options.trie.part_initial_size, 1 << 20);
+        // Deltas are only kept in memory, images left by a crash are stale
+        fs::remove_all(path / "delta");
+        if (fs::exists(path / "fwd.frozen") && fs::exists(path / "rev.frozen")) {
+            base = open_images(path);
+            saved = true;
+        }
+        // Keys inserted after the images were dropped have to be frozen
+        // again before anything can be published
+        covered = base || forward.empty();
+        if (base || (snapshots && covered))
+            publish_snapshot();
+        if (fs::exists(path / "staged"))
+            staged.reset(new stage_db(path / "staged", false));
+    }
+
+    images_ptr open_images(fs::path const& dir)
+    {
+        auto result = boost::make_shared<frozen_images>();
+        result->forward.reset(new frozen_trie(dir / "fwd.frozen"));
+        result->reverse.reset(new frozen_trie(dir / "rev.frozen"));
+        if (fs::exists(dir / "fwd.exact"))
+            result->exact.reset(new exact_table(dir / "fwd.exact"));
+        return result;
+    }
+
+    images_ptr freeze_images(trie& forward, trie& reverse, fs::path const& dir)
+    {
+        // Only forward keys are completed
+        forward.freeze(dir / "fwd.frozen", weight);
+        reverse.freeze(dir / "rev.frozen");
+        frozen_trie keys(dir / "fwd.frozen");
+        exact_table::write(dir / "fwd.exact", [&keys](trie::key_sink_t const& sink) {
+            keys.search_prefix(boost::string_ref(),
+                    [&sink](leaf_id, boost::string_ref const& key) {
+                        sink(key);
+                        return true;
+                    });
+        });
+        return open_images(dir);
+    }
+
+    void publish_snapshot()
+    {
+        auto next = boost::make_shared<snapshot>();
+        if (base)
+            next->images.push_back(base);
+        for (delta const& d : deltas)
+            next->images.push_back(d.images);
+        boost::atomic_store(&published, snapshot_ptr(next));
+    }
+
+    snapshot_ptr current() const
+    {
+        return boost::atomic_load(&published);
+    }
+
+    // Images on disk must match the tries, so the first insert removes them.
+    // Mapped ones stay readable, a published snapshot keeps serving searches.
+    // Without snapshots searches go back to the tries.
+    void drop_frozen()
+    {
+        if (!saved)
+            return;
+        saved = false;
+        fs::remove(path / "fwd.frozen");
+        fs::remove(path / "rev.frozen");
+        fs::remove(path / "fwd.exact");
+        if (!snapshots) {
+            base.reset();
+            boost::atomic_store(&published, snapshot_ptr());
+        }
+    }
+
+    // Refreezes the tries as the new base, replacing the old images in place
+    void freeze()
+    {
+        // Inserts are locked out by the caller, searches may still read the tries
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+        base = freeze_images(forward, reverse, path);
+        lock.unlock();
+        saved = true;
+        covered = true;
+        deltas.clear();
+        delta_keys = 0;
+        pending.clear();
+        publish_snapshot();
+    }
+
+    void publish()
+    {
+        if (!snapshots || pending.empty())
+            return;
+        size_t base_keys = base && base->exact ? base->exact->size() : 0;
+        if (!covered || delta_keys + pending.size() >
+                std::max(MIN_DELTA_KEYS, base_keys / DELTA_RATIO)) {
+            freeze();
+            return;
+        }
+
+        std::vector<std::string> keys;
+        keys.swap(pending);
+        boost::sort(keys);
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        // Deltas no larger than the new one are merged into it, so that
+        // there are only logarithmically many
+        while (!deltas.empty() && deltas.back().keys.size() <= keys.size()) {
+            std::vector<std::string> merged;
+            merged.reserve(keys.size() + deltas.back().keys.size());
+            boost::merge(deltas.back().keys, keys, std::back_inserter(merged));
+            merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+            keys.swap(merged);
+            delta_keys -= deltas.back().keys.size();
+            deltas.pop_back();
+        }
+        images_ptr images = freeze_delta(keys);
+        delta_keys += keys.size();
+        deltas.push_back(delta{ std::move(keys), images });
+        publish_snapshot();
+    }
+
+    // Bulk loads the keys into scratch tries and freezes them. Their images
+    // are unlinked once mapped, so a crash leaves nothing behind.
+    images_ptr freeze_delta(std::vector<std::string> const& keys)
+    {
+        fs::path dir = path / "delta";
+        fs::remove_all(dir);
+        images_ptr result;
+        {
+            // Sorted with EOS, which sorts after every other byte
+            std::vector<std::string> fwd, rev;
+            fwd.reserve(keys.size());
+            rev.reserve(keys.size());
+            for (std::string const& key : keys) {
+                fwd.push_back(key + EOS);
+                rev.emplace_back(key.rbegin(), key.rend());
+                rev.back() += EOS;
+            }
+            boost::sort(fwd);
+            boost::sort(rev);
+            auto source = [](std::vector<std::string> const& sorted) -> trie::key_source_t {
+                return [&sorted](trie::key_sink_t const& sink) {
+                    for (std::string const& key : sorted)
+                        sink(key);
+                };
+            };
+            trie delta_forward(dir / "fwd", delta_options);
+            trie delta_reverse(dir / "rev", delta_options);
+            delta_forward.bulk_load({ source(fwd) });
+            delta_reverse.bulk_load({ source(rev) });
+            result = freeze_images(delta_forward, delta_reverse, dir);
+        }
+        fs::remove_all(dir);
+        return result;
+    }
+
+    // Frozen exact lookups take the hash table instead of a walk
+    void search_exact(trie& target, exact_table const*, boost::string_ref const& data,
+            indexer::index::results_t& results)
+    {
+        target.search_exact(data, results);
+    }
+
+    void search_exact(frozen_trie& target, exact_table const* exact,
+            boost::string_ref const& data, indexer::index::results_t& results)
+    {
+        if (!exact)
+            target.search_exact(data, results);
+        else if (exact->contains(data))
+            results.emplace_back(data);
+    }
+
+    // Staged keys are kept sorted by LevelDB, forward keys under 'f' and
+    // reversed ones under 'r', both with EOS
+    void stage(std::string& s)
+    {
+        if (!staged)
+            staged.reset(new stage_db(path / "staged", false));
+        s.insert(s.begin(), 'f');
+        staged->put(s, boost::string_ref());
+        s[0] = 'r';
+        std::reverse(s.begin() + 1, --s.end());
+        staged->put(s, boost::string_ref());
+        if (++staged_count % 10000 == 0)
+            staged->commit();
+    }
+
+    // Feeds staged keys of the given byte range of one trie, without the prefix
+    trie::key_source_t staged_source(char prefix, uint8_t first = 0, uint8_t last = 255)
+    {
+        return [this, prefix, first, last](trie::key_sink_t const& sink) {
+            auto strip = [&sink](boost::string_ref const& key, boost::string_ref const&) {
+                sink(key.substr(1));
+            };
+            if (first == 0 && last == 255) {
+                staged->scan(std::string(1, prefix), strip);
+                return;
+            }
+            for (size_t b = first; b <= last; ++b)
+                staged->scan(std::string{ prefix, char(b) }, strip);
+        };
+    }
+
+    void load_staged()
+    {
+        staged->commit();
+        drop_frozen();
+        if (forward.empty() && reverse.empty()) {
+            indexer::task_group group(build_executor.get());
+            group.run([this] { bulk_load(forward, 'f'); });
+            group.run([this] { bulk_load(reverse, 'r'); });
+            group.wait();
+        } else {
+            // Sorted inserts still touch far fewer pages than random ones
+            staged_source('f')([this](boost::string_ref const& key) { forward.insert(key); });
+            staged_source('r')([this](boost::string_ref const& key) { reverse.insert(key); });
+        }
+        staged.reset();
+        fs::remove_all(path / "staged");
+        staged_count = 0;
+    }
+
+    // Splits staged keys into ranges of whole first bytes with about the same
+    // number of keys, one per build thread
+    void bulk_load(trie& target, char prefix)
+    {
+        size_t partitions = build_executor ? build_executor->size() : 1;
+        if (partitions < 2) {
+            target.bulk_load({ staged_source(prefix) });
+            return;
+        }
+
+        std::vector<size_t> counts(256);
+        size_t total = 0;
+        staged->scan(std::string(1, prefix),
+                [&](boost::string_ref const& key, boost::string_ref const&) {
+                    ++counts[uint8_t(key[1])];
+                    ++total;
+                });
+
+        std::vector<trie::key_source_t> sources;
+        size_t first = 0, taken = 0, pushed = 0;
+        for (size_t byte = 0; byte < 256; ++byte) {
+            taken += counts[byte];
+            if (taken == pushed)
+                continue;
+            if (byte != 255 && taken * partitions < total * (sources.size() + 1))
+                continue;
+            pushed = taken;
+            sources.push_back(staged_source(prefix, first, byte));
+            first = byte + 1;
+        }
+        target.bulk_load(sources, build_executor.get());
+    }
+
+    template <typename Trie>
+    bool search(Trie& forward, Trie& reverse, exact_table const* exact,
+            boost::string_ref const& data, size_t k, bool has_transp,
+            indexer::index::results_t& results, size_t limit, bool sorted,
+            indexer::index::timing_t& timing);
+    // Searches the images of a snapshot, or the tries under the shared lock
+    // if nothing is published
+    bool search(snapshot_ptr const& snap, boost::string_ref const& data, size_t k,
+            bool has_transp, indexer::index::results_t& results, size_t limit, bool sorted,
+            indexer::index::timing_t& timing);
+
+    fs::path path;
 
     trie forward;
     trie reverse;
 
+    boost::shared_ptr<indexer::executor> executor;
+    boost::shared_ptr<indexer::executor> build_executor;
+
+    bool bulk_build;
+    bool snapshots;
+    trie::weight_fn_t weight;
+    std::unique_ptr<stage_db> staged;
+    std::atomic<size_t> staged_count;
+
+    // Read by searches with atomic_load only
+    snapshot_ptr published;
+
+    // Changed by writers only: whether the images on disk match the tries,
+    // whether the published images and pending keys cover all keys, and
+    // what is published after the base
+    images_ptr base;
+    bool saved;
+    bool covered;
+    std::vector<delta> deltas;
+    size_t delta_keys;
+    std::vector<std::string> pending;
+    trie::options_t delta_options;
+
+    // Writers are serialized by write_mutex and lock out searches of the
+    // tries with mutex, searches of snapshots take neither
+    boost::mutex write_mutex;
     boost::shared_mutex mutex;
 };
 
+template <typename Trie>
+bool pimpl<indexer::index>::implementation::search(Trie& forward, Trie& reverse,
+        exact_table const* exact, boost::string_ref const& data, size_t k, bool has_transp,
+        indexer::index::results_t& results, size_t limit, bool sorted,
+        indexer::index::timing_t& timing)
+{
+    typedef indexer::index::results_t results_t;
+    indexer::stopwatch watch;
+    if (k == 0) {
+        // Earlier images may have found the key already
+        if (boost::find(results, data) == results.end())
+            search_exact(forward, exact, data, results);
+        timing.forward_us += watch.elapsed_us();
+        return false;
+    }
+
+    // Walks find keys in their own order, so only unsorted results can stop
+    // them early, the first keys of a sorted search are known once every
+    // walk is done. One key more than the limit tells whether any are left.
+    size_t walk_limit = sorted || limit == std::numeric_limits<size_t>::max() ?
+        std::numeric_limits<size_t>::max() : limit + 1;
+    size_t switch_len = data.size() / 2;
+    size_t switch_len_1 = data.size() - switch_len;
+
+    // Every split is an independent read-only walk with its own results,
+    // they are merged once the whole group is done. Each walk stops at the
+    // walk limit on its own.
+    std::deque<results_t> partial;
+    std::atomic<uint64_t> forward_us(0), reverse_us(0);
+    std::deque<std::string> patterns;
+    indexer::task_group group(executor.get());
+
+    auto run_splits = [&](std::string const& copy, size_t k) {
+        std::string const& fwd = copy;
+        patterns.push_back(fwd);
+        boost::reverse(patterns.back());
+        std::string const& rev = patterns.back();
+
+        size_t k1 = 0, k2 = k;
+        for (; k2 >= k1; ++k1, --k2) {
+            results_t& out = *partial.emplace(partial.end());
+            group.run([&forward, &fwd, switch_len, k1, k2, has_transp, &out,
+                    walk_limit, &forward_us] {
+                indexer::stopwatch watch;
+                walk_collector collect(out, walk_limit, false);
+                forward.search_split(fwd, switch_len, k1, true, k2, false,
+                        has_transp, std::ref(collect));
+                forward_us += watch.elapsed_us();
+            });
+        }
+        for (; k2 != static_cast<size_t>(-1); ++k1, --k2) {
+            results_t& out = *partial.emplace(partial.end());
+            group.run([&reverse, &rev, switch_len_1, k1, k2, has_transp, &out,
+                    walk_limit, &reverse_us] {
+                indexer::stopwatch watch;
+                // Keys are materialized already turned around
+                walk_collector collect(out, walk_limit, true);
+                reverse.search_split(rev, switch_len_1, k2, false, k1, true,
+                        has_transp, std::ref(collect));
+                reverse_us += watch.elapsed_us();
+            });
+        }
+    };
+
+    if (switch_len == 0) {
+        results_t& out = *partial.emplace(partial.end());
+        walk_collector collect(out, walk_limit, false);
+        forward.search(data, k, has_transp, std::ref(collect));
+        forward_us += watch.elapsed_us();
+    } else {
+        if (has_transp) {
+            patterns.push_back(std::string(data));
+            std::string& copy = patterns.back();
+            std::swap(copy[switch_len - 1], copy[switch_len]);
+
+            if (k == 1) {
+                results_t& out = *partial.emplace(partial.end());
+                group.run([this, &forward, exact, &copy, &out, &forward_us] {
+                    indexer::stopwatch watch;
+                    search_exact(forward, exact, copy, out);
+                    forward_us += watch.elapsed_us();
+                });
+            } else {
+                run_splits(copy, k - 1);
+            }
+        }
+
+        patterns.push_back(std::string(data));
+        run_splits(patterns.back(), k);
+        group.wait();
+    }
+    timing.forward_us += forward_us;
+    timing.reverse_us += reverse_us;
+    watch.lap_us();
+
+    // Walks overlap, duplicates are dropped by hash before anything is
+    // sorted. Results are reserved up front, so the set can point into them.
+    size_t total = results.size();
+    for (auto const& part : partial)
+        total += part.size();
+    results.reserve(total);
+    boost::unordered_set<boost::string_ref, string_ref_hash> seen(total);
+    for (auto const& s : results)
+        seen.insert(s);
+    for (auto& part : partial) {
+        for (auto& s : part) {
+            if (seen.count(s) != 0)
+                continue;
+            results.push_back(std::move(s));
+            seen.insert(results.back());
+        }
+    }
+    if (sorted)
+        boost::sort(results);
+    bool truncated = results.size() > limit;
+    if (truncated)
+        results.resize(limit);
+    timing.merge_us += watch.lap_us();
+    return truncated;
+}
+
+bool pimpl<indexer::index>::implementation::search(snapshot_ptr const& snap,
+        boost::string_ref const& data, size_t k, bool has_transp,
+        indexer::index::results_t& results, size_t limit, bool sorted,
+        indexer::index::timing_t& timing)
+{
+    if (!snap) {
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+        return search(forward, reverse, nullptr, data, k, has_transp, results, limit, sorted,
+                timing);
+    }
+    if (snap->images.size() == 1) {
+        frozen_images& images = *snap->images.front();
+        return search(*images.forward, *images.reverse, images.exact.get(), data, k,
+                has_transp, results, limit, sorted, timing);
+    }
+
+    // Every image adds the keys the ones before it did not have, a key fed
+    // again is in more than one of them
+    bool truncated = false;
+    size_t walk_limit = sorted ? std::numeric_limits<size_t>::max() : limit;
+    for (images_ptr const& images : snap->images) {
+        if (search(*images->forward, *images->reverse, images->exact.get(), data, k,
+                    has_transp, results, walk_limit, false, timing))
+            truncated = true;
+    }
+    indexer::stopwatch watch;
+    if (sorted)
+        boost::sort(results);
+    if (results.size() > limit) {
+        results.resize(limit);
+        truncated = true;
+    }
+    timing.merge_us += watch.elapsed_us();
+    return truncated;
+}
+
 namespace indexer {
 
-index::index(fs::path const& path)
-    : base(path)
+const size_t index::MAX_CORRECTIONS;
+
+index::index(fs::path const& path, options_t const& options)
+    : base(path, options)
 {
 }
 
 void index::insert(boost::string_ref const& data)
 {
     implementation& impl = **this;
-    boost::unique_lock<boost::shared_mutex> lock(impl.mutex);
+    boost::lock_guard<boost::mutex> write(impl.write_mutex);
     std::string s(data);
     // TODO: handle EOS in the trie?
     s += EOS;
-    impl.forward.insert(s);
-    std::reverse(s.begin(), --s.end());
-    impl.reverse.insert(s);
+    if (impl.bulk_build) {
+        impl.stage(s);
+        return;
+    }
+    impl.drop_frozen();
+    {
+        boost::unique_lock<boost::shared_mutex> lock(impl.mutex);
+        impl.forward.insert(s);
+        std::reverse(s.begin(), --s.end());
+        impl.reverse.insert(s);
+    }
+    if (impl.snapshots)
+        impl.pending.emplace_back(data);
 }
 
-void index::search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results)
+void index::publish()
 {
     implementation& impl = **this;
-    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
-    if (k != 0) {
-        size_t switch_len = data.size() / 2;
-        size_t switch_len_1 = data.size() - switch_len;
+    boost::lock_guard<boost::mutex> write(impl.write_mutex);
+    impl.publish();
+}
 
-        if (switch_len == 0) {
-            impl.forward.search(data, k, has_transp, results);
-            return;
-        }
+index::timing_t::timing_t()
+    : forward_us(0), reverse_us(0), merge_us(0)
+{
+}
 
-        results_t rev_results;
-        std::string copy(data);
+bool index::search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results,
+        size_t limit, bool sorted, timing_t* timing)
+{
+    implementation& impl = **this;
+    timing_t local;
+    timing_t& out = timing ? *timing : local;
+    return impl.search(impl.current(), data, k, has_transp, results, limit, sorted, out);
+}
 
-        if (has_transp) {
-            std::swap(copy[switch_len - 1], copy[switch_len]);
+bool index::search_closest(boost::string_ref const& data, size_t max_k, bool has_transp,
+        matches_t& results, size_t limit, bool closest_only, timing_t* timing)
+{
+    implementation& impl = **this;
+    timing_t local;
+    timing_t& out = timing ? *timing : local;
+    results.clear();
+    // Walks report whole distances, so one match more than the limit tells
+    // whether any are left and one match is enough for the closest ones
+    size_t walk_limit = closest_only ? 1 : limit == std::numeric_limits<size_t>::max() ?
+        limit : limit + 1;
+    auto collect = [&results](leaf_id, boost::string_ref const& key, size_t distance) {
+        results.push_back(match{ std::string(key), distance });
+        return true;
+    };
+    snapshot_ptr snap = impl.current();
+    stopwatch watch;
+    if (!snap) {
+        boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+        impl.forward.search_closest(data, max_k, has_transp, collect, walk_limit);
+    } else {
+        for (images_ptr const& images : snap->images)
+            images->forward->search_closest(data, max_k, has_transp, collect, walk_limit);
+    }
+    out.forward_us += watch.lap_us();
 
-            if (k == 1) {
-                impl.forward.search_exact(copy, results);
-            } else {
-                size_t k1 = 0, k2 = k - 1;
-                for (; k2 >= k1; ++k1, --k2) {
-                    impl.forward.search_split(copy, switch_len, k1, true, k2, false,
-                            has_transp, results);
-                }
-                boost::reverse(copy);
-                for (; k2 != static_cast<size_t>(-1); ++k1, --k2) {
-                    impl.reverse.search_split(copy, switch_len_1, k2, false, k1, true,
-                            has_transp, rev_results);
-                }
-                boost::reverse(copy);
-            }
+    boost::sort(results, [](match const& a, match const& b) {
+        return a.distance < b.distance || (a.distance == b.distance && a.key < b.key);
+    });
+    // A key fed again is in more than one image, at the same distance
+    if (snap && snap->images.size() > 1) {
+        results.erase(std::unique(results.begin(), results.end(),
+                    [](match const& a, match const& b) { return a.key == b.key; }),
+                results.end());
+    }
+    if (closest_only && !results.empty()) {
+        size_t closest = results.front().distance;
+        results.erase(boost::find_if(results, [closest](match const& m) {
+                    return m.distance != closest;
+                }), results.end());
+    }
+    bool truncated = results.size() > limit;
+    if (truncated)
+        results.resize(limit);
+    out.merge_us += watch.lap_us();
+    return truncated;
+}
 
-            std::swap(copy[switch_len - 1], copy[switch_len]);
-        }
+bool index::complete(boost::string_ref const& prefix, size_t limit, completions_t& results)
+{
+    implementation& impl = **this;
+    results.clear();
+    snapshot_ptr snap = impl.current();
+    // Live tries carry no subtree weights, they would have to weigh every
+    // key below the prefix
+    if (!snap)
+        return false;
+    if (limit == 0)
+        return true;
+    for (images_ptr const& images : snap->images) {
+        images->forward->search_top(prefix,
+                [&results](leaf_id, boost::string_ref const& key, uint32_t weight) {
+                    results.push_back(completion{ std::string(key), weight });
+                    return true;
+                }, limit);
+    }
+    // Weights only grow, so a key fed again weighs the most where it was
+    // published last
+    boost::sort(results, [](completion const& a, completion const& b) {
+        return a.weight > b.weight || (a.weight == b.weight && a.key < b.key);
+    });
+    if (snap->images.size() < 2)
+        return true;
+    boost::unordered_set<boost::string_ref, string_ref_hash> seen;
+    completions_t unique;
+    unique.reserve(std::min(limit, results.size()));
+    for (completion& c : results) {
+        if (unique.size() == limit)
+            break;
+        if (seen.count(c.key) != 0)
+            continue;
+        unique.push_back(std::move(c));
+        seen.insert(unique.back().key);
+    }
+    results.swap(unique);
+    return true;
+}
 
-        size_t k1 = 0, k2 = k;
-        for (; k2 >= k1; ++k1, --k2) {
-            impl.forward.search_split(copy, switch_len, k1, true, k2, false,
-                    has_transp, results);
-        }
-        boost::reverse(copy);
-        for (; k2 != static_cast<size_t>(-1); ++k1, --k2) {
-            impl.reverse.search_split(copy, switch_len_1, k2, false, k1, true,
-                    has_transp, rev_results);
-        }
-        boost::reverse(copy);
+index::stats_t index::stats() const
+{
+    implementation const& impl = **this;
+    stats_t result;
+    result.forward = impl.forward.stats();
+    result.reverse = impl.reverse.stats();
+    result.staged_keys = impl.staged_count;
+    return result;
+}
 
-        for (auto& s : rev_results) {
-            boost::reverse(s);
-            results.push_back(s);
-        }
+void index::freeze()
+{
+    implementation& impl = **this;
+    boost::lock_guard<boost::mutex> write(impl.write_mutex);
+    impl.freeze();
+}
 
-        boost::erase(results, boost::unique<boost::return_found_end>(boost::sort(results)));
-    } else {
-        impl.forward.search_exact(data, results);
+void index::build()
+{
+    implementation& impl = **this;
+    boost::lock_guard<boost::mutex> write(impl.write_mutex);
+    if (impl.staged) {
+        boost::unique_lock<boost::shared_mutex> lock(impl.mutex);
+        impl.load_staged();
     }
+    impl.freeze();
 }
 
 }
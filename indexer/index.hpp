@@ -4,19 +4,119 @@
 #include <boost/noncopyable.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/utility/string_ref.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "trie.hpp"
 
 namespace indexer {
 
+struct executor;
+
 struct index
     : private pimpl<index>::pointer_semantics
     , public boost::noncopyable
 {
-    index(boost::filesystem::path const& path);
+    struct options_t
+    {
+        options_t()
+            : bulk_build(false)
+            , snapshots(false)
+        {}
+
+        ::trie::options_t trie;
+        // Runs the sub-searches of a fuzzy query in parallel if set
+        boost::shared_ptr<executor> search_executor;
+        // Bulk loads key ranges of both tries in parallel if set
+        boost::shared_ptr<executor> build_executor;
+        // Inserted keys are only staged and become searchable after build()
+        bool bulk_build;
+        // Searches read the last published snapshot without locking and
+        // inserted keys become searchable on publish(). Otherwise searches
+        // lock out inserts and see every key at once.
+        bool snapshots;
+        // Ranks the keys of complete(), all weigh 0 if unset
+        ::trie::weight_fn_t weight;
+    };
+
+    index(boost::filesystem::path const& path, options_t const& options = options_t());
 
     typedef std::vector<std::string> results_t;
+    // Most corrections a search walks with, the limit of the fixed fuzzy
+    // processors
+    static const size_t MAX_CORRECTIONS = 7;
 
     void insert(boost::string_ref const& data);
-    void search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results);
+    // Makes the keys inserted since the last call searchable at once. Their
+    // frozen images are published next to the older ones, which are merged
+    // once there are too many and refrozen with the tries once they make up
+    // a good share of the keys. Does nothing without snapshots.
+    void publish();
+    // Time spent in the steps of a search, walks of the same direction are
+    // summed up even if they ran in parallel
+    struct timing_t
+    {
+        timing_t();
+
+        uint64_t forward_us;
+        uint64_t reverse_us;
+        uint64_t merge_us;
+    };
+
+    // At most limit results are returned, sorted unless that is turned off.
+    // Sorted results are the first ones of all matches. Unsorted ones keep
+    // the order the walks found them in, which is the same for the same
+    // index, and every walk stops at the limit. Either way a search with a
+    // larger limit returns the same results first, so offsets page through
+    // them. Returns whether matches beyond the limit were left out.
+    bool search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results,
+            size_t limit = std::numeric_limits<size_t>::max(), bool sorted = true,
+            timing_t* timing = nullptr);
+
+    struct match
+    {
+        std::string key;
+        size_t distance;
+    };
+    typedef std::vector<match> matches_t;
+
+    // Finds the keys up to max_k corrections away and returns them closest
+    // first, then by key. Walks go closest first and stop at the distance
+    // where limit is reached. With closest_only only the matches at the
+    // smallest distance are returned, at most limit of them.
+    bool search_closest(boost::string_ref const& data, size_t max_k, bool has_transp,
+            matches_t& results, size_t limit = std::numeric_limits<size_t>::max(),
+            bool closest_only = false, timing_t* timing = nullptr);
+
+    struct completion
+    {
+        std::string key;
+        uint32_t weight;
+    };
+    typedef std::vector<completion> completions_t;
+
+    // Up to limit keys starting with prefix, heaviest first, then by key.
+    // Frozen images carry the weights of their subtrees and only walk the
+    // heaviest ones. Returns false if there are none to complete from, as
+    // before the first freeze or publish and after an insert without
+    // snapshots.
+    bool complete(boost::string_ref const& prefix, size_t limit, completions_t& results);
+
+    struct stats_t
+    {
+        ::trie::stats_t forward;
+        ::trie::stats_t reverse;
+        // Keys waiting for build()
+        uint64_t staged_keys;
+    };
+    // Doesn't wait for running inserts or builds
+    stats_t stats() const;
+
+    // Compiles both tries into read-only images and serves searches from them,
+    // until the next insert unless there are snapshots
+    void freeze();
+    // Loads staged keys, bulk loading them if the tries are still empty,
+    // then freezes
+    void build();
 };
 
 }
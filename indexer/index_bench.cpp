@@ -0,0 +1,453 @@
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "fuzzy_processor.hpp"
+#include "trie.hpp"
+#include "index.hpp"
+#include "executor.hpp"
+#include "metrics.hpp"
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+using indexer::stopwatch;
+
+static const std::string EOS = "\xFF";
+
+// Results are written one JSON object per line, so that runs can be
+// compared by scripts
+struct report
+{
+    report(std::ostream& out)
+        : out_(out)
+    {}
+
+    report& begin(std::string const& bench)
+    {
+        bench_ = bench;
+        line_ = "{\"bench\": \"" + bench + "\"";
+        return *this;
+    }
+
+    template <typename T>
+    report& field(std::string const& name, T const& value)
+    {
+        line_ += str(boost::format(", \"%1%\": %2%") % name % value);
+        return *this;
+    }
+
+    report& field(std::string const& name, std::string const& value)
+    {
+        line_ += ", \"" + name + "\": \"" + value + "\"";
+        return *this;
+    }
+
+    report& field(std::string const& name, bool value)
+    {
+        line_ += ", \"" + name + "\": " + (value ? "true" : "false");
+        return *this;
+    }
+
+    // Adds count, mean and percentiles of the samples, in nanoseconds
+    report& latencies(std::vector<uint64_t>& samples)
+    {
+        field("count", samples.size());
+        if (samples.empty())
+            return *this;
+        std::sort(samples.begin(), samples.end());
+        uint64_t total = 0;
+        for (uint64_t s : samples)
+            total += s;
+        auto at = [&samples](double q) {
+            return samples[static_cast<size_t>(q * (samples.size() - 1))];
+        };
+        return field("mean_ns", total / samples.size())
+            .field("p50_ns", at(0.5))
+            .field("p90_ns", at(0.9))
+            .field("p99_ns", at(0.99))
+            .field("max_ns", samples.back());
+    }
+
+    void end()
+    {
+        out_ << line_ << "}" << std::endl;
+        // Progress only, results go to the output file
+        std::cerr << "Done " << bench_ << std::endl;
+    }
+
+private:
+    std::ostream& out_;
+    std::string bench_;
+    std::string line_;
+};
+
+// Distinct random words, more frequent ones first
+std::vector<std::string> make_vocabulary(size_t size, std::mt19937& rng)
+{
+    std::uniform_int_distribution<int> length(3, 12);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    boost::unordered_set<std::string> seen;
+    std::vector<std::string> result;
+    result.reserve(size);
+    while (result.size() < size) {
+        std::string word(length(rng), ' ');
+        for (char& c : word)
+            c = letter(rng);
+        if (seen.insert(word).second)
+            result.push_back(word);
+    }
+    return result;
+}
+
+// Zipfian ranks over the vocabulary
+struct zipf_sampler
+{
+    zipf_sampler(size_t size, double s)
+    {
+        std::vector<double> weights(size);
+        for (size_t i = 0; i < size; ++i)
+            weights[i] = 1.0 / std::pow(double(i + 1), s);
+        dist_ = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    }
+
+    size_t operator()(std::mt19937& rng)
+    { return dist_(rng); }
+
+private:
+    std::discrete_distribution<size_t> dist_;
+};
+
+// Applies up to k random substitutions, insertions, deletions or transpositions
+std::string misspell(std::string word, size_t k, std::mt19937& rng)
+{
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::uniform_int_distribution<int> kind(0, 3);
+    for (size_t i = 0; i < k && word.size() > 1; ++i) {
+        size_t pos = std::uniform_int_distribution<size_t>(0, word.size() - 1)(rng);
+        switch (kind(rng)) {
+            case 0: word[pos] = letter(rng); break;
+            case 1: word.insert(word.begin() + pos, letter(rng)); break;
+            case 2: word.erase(pos, 1); break;
+            case 3:
+                if (pos + 1 < word.size())
+                    std::swap(word[pos], word[pos + 1]);
+                break;
+        }
+    }
+    return word;
+}
+
+std::vector<std::string> load_query_log(fs::path const& path)
+{
+    std::ifstream in(path.string());
+    if (!in)
+        throw std::runtime_error("Cannot open query log " + path.string());
+    std::vector<std::string> result;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty())
+            result.push_back(line);
+    }
+    return result;
+}
+
+std::string source_name(bool from_log)
+{
+    return from_log ? "log" : "zipf";
+}
+
+void bench_fuzzy(report& out, std::vector<std::string> const& vocabulary, size_t rounds,
+        std::mt19937& rng)
+{
+    std::uniform_int_distribution<size_t> pick(0, vocabulary.size() - 1);
+    std::vector<std::string> texts;
+    for (size_t i = 0; i < rounds; ++i)
+        texts.push_back(vocabulary[pick(rng)]);
+
+    for (size_t length : { 4, 8, 16, 32 }) {
+        std::string pattern;
+        while (pattern.size() < length)
+            pattern += vocabulary[pick(rng)];
+        pattern.resize(length);
+        for (size_t k = 0; k <= 3; ++k) {
+            fuzzy_processor proc(pattern, k, true);
+
+            size_t matches = 0, chars = 0;
+            stopwatch watch;
+            for (std::string const& text : texts) {
+                chars += text.size();
+                if (proc.check(text, true))
+                    ++matches;
+            }
+            uint64_t check_ns = watch.elapsed_ns();
+            out.begin("fuzzy_check").field("pattern_len", length).field("k", k)
+                .field("texts", texts.size()).field("matches", matches)
+                .field("ns_per_char", double(check_ns) / chars).end();
+
+            // Walks texts char by char the way trie walks do
+            size_t fed = 0;
+            watch.lap_ns();
+            fuzzy_processor::context root(proc);
+            for (std::string const& text : texts) {
+                fuzzy_processor::context ctx = proc.fork(root);
+                bool is_final;
+                for (char c : text) {
+                    proc.feed(c, ctx);
+                    ++fed;
+                    if (!proc.query(ctx, is_final))
+                        break;
+                }
+            }
+            uint64_t feed_ns = watch.elapsed_ns();
+            out.begin("fuzzy_feed").field("pattern_len", length).field("k", k)
+                .field("chars", fed).field("ns_per_char", fed ? double(feed_ns) / fed : 0.0)
+                .end();
+        }
+    }
+}
+
+void bench_insert(report& out, trie& target, std::vector<std::string> const& vocabulary,
+        size_t step)
+{
+    std::vector<std::string> keys(vocabulary);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+    for (size_t start = 0; start < keys.size(); start += step) {
+        size_t end = std::min(keys.size(), start + step);
+        stopwatch watch;
+        for (size_t i = start; i < end; ++i)
+            target.insert(keys[i] + EOS);
+        uint64_t ns = watch.elapsed_ns();
+        trie::stats_t stats = target.stats();
+        out.begin("trie_insert").field("keys_before", start).field("keys", end - start)
+            .field("ns_per_key", double(ns) / (end - start))
+            .field("parts", stats.parts).field("bytes_mapped", stats.bytes_mapped)
+            .field("part_switches", stats.part_switches).field("node_splits", stats.node_splits)
+            .end();
+    }
+}
+
+// Feeds keys in batches the way feedData does, publishing after each
+void bench_publish(report& out, indexer::index& target,
+        std::vector<std::string> const& vocabulary, size_t batch)
+{
+    std::vector<std::string> keys(vocabulary);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+    uint64_t insert_ns = 0, publish_ns = 0, publish_max_ns = 0;
+    size_t batches = 0;
+    for (size_t start = 0; start < keys.size(); start += batch, ++batches) {
+        size_t end = std::min(keys.size(), start + batch);
+        stopwatch watch;
+        for (size_t i = start; i < end; ++i)
+            target.insert(keys[i]);
+        insert_ns += watch.lap_ns();
+        target.publish();
+        uint64_t ns = watch.lap_ns();
+        publish_ns += ns;
+        publish_max_ns = std::max(publish_max_ns, ns);
+    }
+    out.begin("index_publish").field("keys", keys.size()).field("batch", batch)
+        .field("insert_ns_per_key", double(insert_ns) / keys.size())
+        .field("publish_ns_per_key", double(publish_ns) / keys.size())
+        .field("publish_us", double(publish_ns) / batches / 1000)
+        .field("publish_max_us", double(publish_max_ns) / 1000).end();
+}
+
+template <typename Search>
+void bench_search(report& out, std::string const& bench, bool from_log,
+        std::vector<std::string> const& queries, Search search)
+{
+    for (size_t k = 0; k <= 3; ++k) {
+        for (bool has_transp : { false, true }) {
+            std::vector<uint64_t> samples;
+            samples.reserve(queries.size());
+            size_t results = 0;
+            for (std::string const& query : queries) {
+                stopwatch watch;
+                results += search(query, k, has_transp);
+                samples.push_back(watch.elapsed_ns());
+            }
+            out.begin(bench).field("queries", source_name(from_log)).field("k", k)
+                .field("transpositions", has_transp).field("results", results)
+                .latencies(samples).end();
+        }
+    }
+}
+
+// Completes prefixes of the queries cut to 1 to 3 bytes
+void bench_complete(report& out, std::string const& bench, bool from_log,
+        std::vector<std::string> const& queries, indexer::index& idx, size_t limit)
+{
+    for (size_t length = 1; length <= 3; ++length) {
+        std::vector<uint64_t> samples;
+        samples.reserve(queries.size());
+        size_t results = 0;
+        indexer::index::completions_t completions;
+        for (std::string const& query : queries) {
+            stopwatch watch;
+            idx.complete(boost::string_ref(query).substr(0, length), limit, completions);
+            samples.push_back(watch.elapsed_ns());
+            results += completions.size();
+        }
+        out.begin(bench).field("queries", source_name(from_log)).field("prefix_len", length)
+            .field("limit", limit).field("results", results).latencies(samples).end();
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help", "produce this help message")
+        ("dir,d", po::value<fs::path>()->default_value("bench_data"),
+            "set scratch directory, its contents are removed")
+        ("output,o", po::value<fs::path>()->default_value("bench.jsonl"),
+            "set file for JSON lines results")
+        ("words", po::value<size_t>()->default_value(100000), "set vocabulary size")
+        ("zipf", po::value<double>()->default_value(1.0), "set Zipf exponent of query words")
+        ("queries", po::value<size_t>()->default_value(1000), "set number of generated queries")
+        ("typos", po::value<size_t>()->default_value(1), "set maximum typos per generated query")
+        ("query-log", po::value<fs::path>(), "also run searches from a log, one query per line")
+        ("part-size", po::value<size_t>()->default_value(1 << 20),
+            "set initial trie part size, small parts exercise growing and spilling")
+        ("part-limit", po::value<size_t>()->default_value(16 << 20), "set trie part size limit")
+        ("publish-batch", po::value<size_t>()->default_value(1000),
+            "set number of keys fed between publishes of a snapshot")
+        ("search-threads", po::value<size_t>()->default_value(0),
+            "set number of threads for index searches")
+        ("seed", po::value<unsigned>()->default_value(42), "set random seed")
+        ;
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+    if (vm.count("help")) {
+        std::cout << "Benchmarks of fuzzy_processor, trie and index" << std::endl;
+        std::cout << "Usage: index_bench [options]" << std::endl;
+        std::cout << desc << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    po::notify(vm);
+
+    fs::path dir = vm["dir"].as<fs::path>();
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    std::ofstream results_file(vm["output"].as<fs::path>().string());
+    if (!results_file) {
+        std::cerr << "Cannot open " << vm["output"].as<fs::path>() << std::endl;
+        return EXIT_FAILURE;
+    }
+    report out(results_file);
+
+    std::mt19937 rng(vm["seed"].as<unsigned>());
+    std::vector<std::string> vocabulary = make_vocabulary(vm["words"].as<size_t>(), rng);
+
+    std::vector<std::pair<bool, std::vector<std::string>>> query_sets;
+    {
+        zipf_sampler zipf(vocabulary.size(), vm["zipf"].as<double>());
+        std::uniform_int_distribution<size_t> typos(0, vm["typos"].as<size_t>());
+        std::vector<std::string> queries;
+        for (size_t i = 0; i < vm["queries"].as<size_t>(); ++i)
+            queries.push_back(misspell(vocabulary[zipf(rng)], typos(rng), rng));
+        query_sets.emplace_back(false, queries);
+    }
+    if (vm.count("query-log"))
+        query_sets.emplace_back(true, load_query_log(vm["query-log"].as<fs::path>()));
+
+    bench_fuzzy(out, vocabulary, 100000, rng);
+
+    trie::options_t trie_options;
+    trie_options.part_initial_size = vm["part-size"].as<size_t>();
+    trie_options.part_size_limit = vm["part-limit"].as<size_t>();
+
+    trie words(dir / "trie", trie_options, false);
+    bench_insert(out, words, vocabulary, std::max<size_t>(vocabulary.size() / 20, 1));
+
+    // Frequent words weigh more, as document frequencies would
+    boost::unordered_map<std::string, uint32_t> weights;
+    for (size_t i = 0; i < vocabulary.size(); ++i)
+        weights.emplace(vocabulary[i], vocabulary.size() - i);
+
+    indexer::index::options_t index_options;
+    index_options.trie = trie_options;
+    index_options.weight = [&weights](boost::string_ref const& key) {
+        auto it = weights.find(std::string(key));
+        return it == weights.end() ? 0 : it->second;
+    };
+    if (vm["search-threads"].as<size_t>() != 0)
+        index_options.search_executor = boost::make_shared<indexer::executor>(
+                vm["search-threads"].as<size_t>());
+    indexer::index idx(dir / "index", index_options);
+    for (std::string const& word : vocabulary)
+        idx.insert(word);
+
+    for (auto const& queries : query_sets) {
+        bench_search(out, "trie_search", queries.first, queries.second,
+                [&words](std::string const& q, size_t k, bool has_transp) {
+                    trie::results_t results;
+                    words.search(q, k, has_transp, results);
+                    return results.size();
+                });
+        // The first split of index::search, exact first half
+        bench_search(out, "trie_search_split", queries.first, queries.second,
+                [&words](std::string const& q, size_t k, bool has_transp) {
+                    trie::results_t results;
+                    words.search_split(q, q.size() / 2, 0, true, k, false, has_transp,
+                            results);
+                    return results.size();
+                });
+        bench_search(out, "index_search", queries.first, queries.second,
+                [&idx](std::string const& q, size_t k, bool has_transp) {
+                    indexer::index::results_t results;
+                    idx.search(q, k, has_transp, results);
+                    return results.size();
+                });
+        // Closest matches within k from a single walk, compare with escalating k
+        bench_search(out, "index_search_closest", queries.first, queries.second,
+                [&idx](std::string const& q, size_t k, bool has_transp) {
+                    indexer::index::matches_t results;
+                    idx.search_closest(q, k, has_transp, results,
+                            std::numeric_limits<size_t>::max(), true);
+                    return results.size();
+                });
+    }
+
+    idx.freeze();
+    for (auto const& queries : query_sets) {
+        bench_search(out, "index_search_frozen", queries.first, queries.second,
+                [&idx](std::string const& q, size_t k, bool has_transp) {
+                    indexer::index::results_t results;
+                    idx.search(q, k, has_transp, results);
+                    return results.size();
+                });
+        bench_complete(out, "index_complete_frozen", queries.first, queries.second, idx, 10);
+    }
+
+    // Searches read a frozen base and the deltas published since
+    indexer::index::options_t snapshot_options = index_options;
+    snapshot_options.snapshots = true;
+    indexer::index published(dir / "published", snapshot_options);
+    bench_publish(out, published, vocabulary, vm["publish-batch"].as<size_t>());
+    for (auto const& queries : query_sets) {
+        bench_search(out, "index_search_published", queries.first, queries.second,
+                [&published](std::string const& q, size_t k, bool has_transp) {
+                    indexer::index::results_t results;
+                    published.search(q, k, has_transp, results);
+                    return results.size();
+                });
+        bench_complete(out, "index_complete_published", queries.first, queries.second,
+                published, 10);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,98 +1,367 @@
 #include "index_builder.hpp"
 #include <iostream>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
 
 #include "exceptions.hpp"
 #include "index.hpp"
+#include "request_dispatcher.hpp"
+#include "metrics.hpp"
 
 namespace fs = boost::filesystem;
 
+static void fill_trie_stats(indexer::TrieStats& out, trie::stats_t const& stats)
+{
+    out.set_keys_inserted(stats.keys_inserted);
+    out.set_node_splits(stats.node_splits);
+    out.set_part_switches(stats.part_switches);
+    out.set_parts(stats.parts);
+    out.set_bytes_mapped(stats.bytes_mapped);
+}
+
 template <>
 struct pimpl<indexer::IndexBuilder>::implementation
 {
+    // A single worker keeps builder requests in the order they came in,
+    // pipelined batches are applied in that order by a single ingest thread
+    implementation(boost::shared_ptr<indexer::store_manager> const& store_mgr,
+            indexer::IndexBuilder::options_t const& options)
+        : store_mgr(store_mgr)
+        , ingest_capacity(options.ingest_queue)
+        , queued(0)
+        , applied_batches(0)
+        , applied_records(0)
+        , failed_batches(0)
+        , records_fed(0)
+        , index_insert_us(0)
+        , value_commits(0)
+        , value_commit_us(0)
+        , value_commit_max_us(0)
+        , index_publish_us(0)
+        , index_publish_max_us(0)
+        , last_build_us(0)
+        , ingest(1)
+        , dispatcher(1, options.max_in_flight)
+    {}
+
+    void apply(indexer::store& target, const indexer::BuilderData& data);
+    // Progress reports read the store from the rpcz thread
+    void set_store(indexer::store_manager::store_ptr const& value);
+    // Waits until all pipelined batches are applied
+    void drain();
+
+    void create_store(const indexer::StoreParameters& request, rpcz::reply<indexer::Void> reply);
+    void open_store(const indexer::StoreParameters& request, rpcz::reply<indexer::Void> reply);
+    void close_store(const indexer::Void& request, rpcz::reply<indexer::Void> reply);
+    void feed_data(const indexer::BuilderData& request, rpcz::reply<indexer::Void> reply);
+    void build_index(const indexer::Void& request, rpcz::reply<indexer::Void> reply);
+    void get_progress(rpcz::reply<indexer::BuilderProgress> reply);
+
     boost::shared_ptr<indexer::store_manager> store_mgr;
     indexer::store_manager::store_ptr store;
+
+    size_t ingest_capacity;
+    size_t queued;
+    uint64_t applied_batches;
+    uint64_t applied_records;
+    uint64_t failed_batches;
+    std::string last_error;
+    uint64_t records_fed;
+    uint64_t index_insert_us;
+    uint64_t value_commits;
+    uint64_t value_commit_us;
+    uint64_t value_commit_max_us;
+    uint64_t index_publish_us;
+    uint64_t index_publish_max_us;
+    uint64_t last_build_us;
+    boost::mutex progress_mutex;
+    boost::condition_variable progress_changed;
+
+    // Destroyed before the counters, applies what is still queued
+    indexer::executor ingest;
+    indexer::request_dispatcher dispatcher;
 };
 
-namespace indexer {
+void pimpl<indexer::IndexBuilder>::implementation::apply(indexer::store& target,
+        const indexer::BuilderData& data)
+{
+    using namespace indexer;
+    auto index = target.index();
+    auto db = target.db();
+    auto terms = target.terms();
+    auto dbtx = db->start_tx();
+    std::string value_str;
+    uint64_t insert_us = 0;
+    for (IndexRecord const& rec : data.records()) {
+        term_id id = terms->assign(rec.key());
+        terms->add_weight(id, rec.has_weight() ? rec.weight() : rec.value().parts_size());
+        stopwatch insert;
+        index->insert(rec.key());
+        insert_us += insert.elapsed_us();
+        rec.value().SerializeToString(&value_str);
+        dbtx->append(id, value_str);
+    }
+    stopwatch commit;
+    // Postings never refer to IDs that are not persisted
+    terms->commit();
+    dbtx->commit();
+    uint64_t commit_us = commit.elapsed_us();
+    // The batch becomes searchable only once its values can be fetched
+    stopwatch publish;
+    index->publish();
+    uint64_t publish_us = publish.elapsed_us();
+    std::vector<std::string> keys;
+    keys.reserve(data.records_size());
+    for (IndexRecord const& rec : data.records())
+        keys.push_back(rec.key());
+    target.cache()->invalidate(keys);
+
+    boost::lock_guard<boost::mutex> lock(progress_mutex);
+    index_insert_us += insert_us;
+    ++value_commits;
+    value_commit_us += commit_us;
+    value_commit_max_us = std::max(value_commit_max_us, commit_us);
+    index_publish_us += publish_us;
+    index_publish_max_us = std::max(index_publish_max_us, publish_us);
+}
 
-IndexBuilder::IndexBuilder(boost::shared_ptr<store_manager> const& store_mgr)
+void pimpl<indexer::IndexBuilder>::implementation::set_store(
+        indexer::store_manager::store_ptr const& value)
 {
-    (*this)->store_mgr = store_mgr;
+    boost::lock_guard<boost::mutex> lock(progress_mutex);
+    store = value;
 }
 
-IndexBuilder::~IndexBuilder()
+void pimpl<indexer::IndexBuilder>::implementation::drain()
 {
+    boost::unique_lock<boost::mutex> lock(progress_mutex);
+    while (queued != 0)
+        progress_changed.wait(lock);
 }
 
-void IndexBuilder::createStore(const StoreParameters& request, rpcz::reply<Void> reply)
+void pimpl<indexer::IndexBuilder>::implementation::create_store(const indexer::StoreParameters& request,
+        rpcz::reply<indexer::Void> reply)
 {
-    implementation& impl = **this;
+    using namespace indexer;
     try {
         std::cout << "Got createStore request: '" << request.DebugString() << "'" << std::endl;
 
-        impl.store = impl.store_mgr->create(request);
+        drain();
+        set_store(store_mgr->create(request));
 
     } RPC_REPORT_EXCEPTIONS(reply)
     reply.send(Void());
 }
 
-void IndexBuilder::openStore(const StoreParameters& request, rpcz::reply<Void> reply)
+void pimpl<indexer::IndexBuilder>::implementation::open_store(const indexer::StoreParameters& request,
+        rpcz::reply<indexer::Void> reply)
 {
-    implementation& impl = **this;
+    using namespace indexer;
     try {
         std::cout << "Got openStore request: '" << request.DebugString() << "'" << std::endl;
+        drain();
 
-        impl.store = impl.store_mgr->open(request.location());
+        set_store(store_mgr->open(request.location()));
     } RPC_REPORT_EXCEPTIONS(reply)
     reply.send(Void());
 }
 
-void IndexBuilder::closeStore(const Void& request, rpcz::reply<Void> reply)
+void pimpl<indexer::IndexBuilder>::implementation::close_store(const indexer::Void& request,
+        rpcz::reply<indexer::Void> reply)
 {
-    implementation& impl = **this;
+    using namespace indexer;
     try {
         std::cout << "Got closeStore request: '" << request.DebugString() << "'" << std::endl;
-        impl.store.reset();
+        drain();
+        set_store(indexer::store_manager::store_ptr());
 
     } RPC_REPORT_EXCEPTIONS(reply)
     reply.send(Void());
 }
 
-void IndexBuilder::feedData(const BuilderData& request, rpcz::reply<Void> reply)
+void pimpl<indexer::IndexBuilder>::implementation::feed_data(const indexer::BuilderData& request,
+        rpcz::reply<indexer::Void> reply)
 {
-    implementation& impl = **this;
+    using namespace indexer;
     try {
-        if (!impl.store)
+        if (!store)
             BOOST_THROW_EXCEPTION(common_exception()
                 << errinfo_rpc_code(::rpc_error::INVALID_STORE)
                 << errinfo_message("Store is not open"));
         //std::cout << "Feeding " << request.records_size() << " records" << std::endl;
-        auto index = impl.store->index();
-        auto db = impl.store->db();
-        auto dbtx = db->start_tx();
-        std::string value_str;
-        for (IndexRecord const& rec : request.records()) {
-            index->insert(rec.key());
-            rec.value().SerializeToString(&value_str);
-            dbtx->append(rec.key(), value_str);
+        if (!request.pipelined()) {
+            drain();
+            {
+                boost::lock_guard<boost::mutex> lock(progress_mutex);
+                records_fed += request.records_size();
+            }
+            apply(*store, request);
+            boost::lock_guard<boost::mutex> lock(progress_mutex);
+            ++applied_batches;
+            applied_records += request.records_size();
+        } else {
+            {
+                boost::lock_guard<boost::mutex> lock(progress_mutex);
+                if (queued >= ingest_capacity)
+                    BOOST_THROW_EXCEPTION(common_exception()
+                        << errinfo_rpc_code(::rpc_error::SERVER_BUSY)
+                        << errinfo_message(str(boost::format(
+                                "Ingest queue is full, capacity is %d") % ingest_capacity)));
+                // Counted with its queue slot, before a worker can apply it
+                ++queued;
+                records_fed += request.records_size();
+            }
+            auto target = store;
+            auto data = boost::make_shared<BuilderData>(request);
+            ingest.submit([this, target, data] {
+                bool ok = false;
+                std::string error;
+                try {
+                    apply(*target, *data);
+                    ok = true;
+                } catch (...) {
+                    error = boost::current_exception_diagnostic_information();
+                    std::cerr << "Pipelined batch failed: " << error << std::endl;
+                }
+                boost::lock_guard<boost::mutex> lock(progress_mutex);
+                --queued;
+                if (ok) {
+                    ++applied_batches;
+                    applied_records += data->records_size();
+                } else {
+                    ++failed_batches;
+                    last_error = error;
+                }
+                progress_changed.notify_all();
+            });
         }
-        dbtx->commit();
     } RPC_REPORT_EXCEPTIONS(reply)
     reply.send(Void());
 }
 
-void IndexBuilder::buildIndex(const Void& request, rpcz::reply<Void> reply)
+void pimpl<indexer::IndexBuilder>::implementation::build_index(const indexer::Void& request,
+        rpcz::reply<indexer::Void> reply)
 {
+    using namespace indexer;
     try {
-        BOOST_THROW_EXCEPTION(common_exception()
-                << errinfo_rpc_code(rpcz::application_error::METHOD_NOT_IMPLEMENTED));
-        std::cout << "Got request: '" << request.DebugString() << "'" << std::endl;
-        std::cout << "Building index!!!" << std::endl;
+        std::cout << "Got buildIndex request: '" << request.DebugString() << "'" << std::endl;
+        if (!store)
+            BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                << errinfo_message("Store is not open"));
+        drain();
+        stopwatch build;
+        store->index()->build();
+        // Staged keys have just become searchable
+        store->cache()->invalidate();
+        boost::lock_guard<boost::mutex> lock(progress_mutex);
+        last_build_us = build.elapsed_us();
     } RPC_REPORT_EXCEPTIONS(reply)
     reply.send(Void());
 }
 
+void pimpl<indexer::IndexBuilder>::implementation::get_progress(
+        rpcz::reply<indexer::BuilderProgress> reply)
+{
+    indexer::BuilderProgress progress;
+    indexer::store_manager::store_ptr target;
+    {
+        boost::lock_guard<boost::mutex> lock(progress_mutex);
+        target = store;
+        uint64_t done = applied_batches + failed_batches;
+        progress.set_progress(done + queued ? double(done) / (done + queued) : 1.0);
+        progress.set_queued_batches(queued);
+        progress.set_queue_capacity(ingest_capacity);
+        progress.set_applied_batches(applied_batches);
+        progress.set_applied_records(applied_records);
+        progress.set_failed_batches(failed_batches);
+        if (!last_error.empty())
+            progress.set_last_error(last_error);
+        progress.set_records_fed(records_fed);
+        progress.set_index_insert_us(index_insert_us);
+        progress.set_value_commits(value_commits);
+        progress.set_value_commit_us(value_commit_us);
+        progress.set_value_commit_max_us(value_commit_max_us);
+        progress.set_index_publish_us(index_publish_us);
+        progress.set_index_publish_max_us(index_publish_max_us);
+        progress.set_last_build_us(last_build_us);
+    }
+    if (target) {
+        auto stats = target->index()->stats();
+        fill_trie_stats(*progress.mutable_forward(), stats.forward);
+        fill_trie_stats(*progress.mutable_reverse(), stats.reverse);
+        progress.set_staged_keys(stats.staged_keys);
+    }
+    reply.send(progress);
+}
+
+namespace indexer {
+
+IndexBuilder::options_t::options_t()
+    : max_in_flight(1024)
+    , ingest_queue(64)
+{
+}
+
+IndexBuilder::IndexBuilder(boost::shared_ptr<store_manager> const& store_mgr,
+        options_t const& options)
+    : base(store_mgr, options)
+{
 }
 
+IndexBuilder::~IndexBuilder()
+{
+}
+
+void IndexBuilder::createStore(const StoreParameters& request, rpcz::reply<Void> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<Void> reply) {
+        impl.create_store(request, reply);
+    });
+}
+
+void IndexBuilder::openStore(const StoreParameters& request, rpcz::reply<Void> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<Void> reply) {
+        impl.open_store(request, reply);
+    });
+}
+
+void IndexBuilder::closeStore(const Void& request, rpcz::reply<Void> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<Void> reply) {
+        impl.close_store(request, reply);
+    });
+}
+
+void IndexBuilder::feedData(const BuilderData& request, rpcz::reply<Void> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<Void> reply) {
+        impl.feed_data(request, reply);
+    });
+}
+
+void IndexBuilder::buildIndex(const Void& request, rpcz::reply<Void> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<Void> reply) {
+        impl.build_index(request, reply);
+    });
+}
+
+// Answered on the rpcz thread, so that it is not queued behind a long build
+void IndexBuilder::getProgress(const Void& request, rpcz::reply<BuilderProgress> reply)
+{
+    (*this)->get_progress(reply);
+}
+
+}
@@ -14,7 +14,18 @@ struct IndexBuilder
     , public boost::noncopyable
     , private pimpl<IndexBuilder>::pointer_semantics
 {
-    IndexBuilder(boost::shared_ptr<store_manager> const& store_mgr);
+    struct options_t
+    {
+        options_t();
+
+        // Requests queued or running, the rest are rejected with SERVER_BUSY
+        size_t max_in_flight;
+        // Pipelined feedData batches waiting to be applied
+        size_t ingest_queue;
+    };
+
+    IndexBuilder(boost::shared_ptr<store_manager> const& store_mgr,
+            options_t const& options = options_t());
     virtual ~IndexBuilder();
 
 private:
@@ -23,6 +34,7 @@ private:
     virtual void closeStore(const Void& request, rpcz::reply<Void> reply);
     virtual void feedData(const BuilderData& request, rpcz::reply<Void> reply);
     virtual void buildIndex(const Void& request, rpcz::reply<Void> reply);
+    virtual void getProgress(const Void& request, rpcz::reply<BuilderProgress> reply);
 };
 
 }
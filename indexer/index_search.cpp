@@ -2,73 +2,388 @@
 #include <iostream>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/make_shared.hpp>
 
 #include "exceptions.hpp"
 #include "index.hpp"
+#include "request_dispatcher.hpp"
+#include "metrics.hpp"
 
 namespace fs = boost::filesystem;
 
 template <>
 struct pimpl<indexer::IndexSearch>::implementation
 {
+    implementation(boost::shared_ptr<indexer::store_manager> const& store_mgr,
+            indexer::IndexSearch::options_t const& options)
+        : store_mgr(store_mgr)
+        , dispatcher(options.workers, options.max_in_flight)
+    {}
+
+    void use_store(const indexer::UseStore& request, rpcz::reply<indexer::Void> reply);
+    void word_query(const indexer::WordQuery& request, rpcz::reply<indexer::QueryResult> reply);
+    void batch_query(const indexer::BatchQuery& request,
+            rpcz::reply<indexer::BatchQueryResult> reply);
+
+    void run_query(indexer::store const& store, const indexer::WordQuery& request,
+            indexer::QueryResult& pb_results);
+    // Keys of a word query, without the offset applied
+    indexer::query_cache::result_ptr search(indexer::index& index,
+            const indexer::WordQuery& request, size_t limit);
+    void get_stats(rpcz::reply<indexer::SearchStats> reply);
+    void prefix_query(const indexer::PrefixQuery& request,
+            rpcz::reply<indexer::QueryResult> reply);
+
+    indexer::store_manager::store_ptr open_store()
+    {
+        boost::lock_guard<boost::mutex> lock(store_mutex);
+        if (!store)
+            BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                << errinfo_message("Store is not open"));
+        return store;
+    }
+
     boost::shared_ptr<indexer::store_manager> store_mgr;
     indexer::store_manager::store_ptr store;
+    boost::mutex store_mutex;
+
+    indexer::query_metrics metrics;
+
+    indexer::request_dispatcher dispatcher;
 };
 
-namespace indexer {
+void pimpl<indexer::IndexSearch>::implementation::use_store(const indexer::UseStore& request,
+        rpcz::reply<indexer::Void> reply)
+{
+    try {
+        std::cout << "Got useStore request: '" << request.DebugString() << "'" << std::endl;
+
+        auto opened = store_mgr->open(request.location());
+        boost::lock_guard<boost::mutex> lock(store_mutex);
+        // Nothing cached before the switch is trusted
+        if (opened != store)
+            opened->cache()->clear();
+        store = opened;
+    } RPC_REPORT_EXCEPTIONS(reply)
+    reply.send(indexer::Void());
+}
 
-IndexSearch::IndexSearch(boost::shared_ptr<store_manager> const& store_mgr)
+// Everything the keys of a word query depend on
+static std::string cache_key(const indexer::WordQuery& request, size_t limit)
 {
-    (*this)->store_mgr = store_mgr;
+    indexer::QueryOptions const& options = request.options();
+    return str(boost::format("%d:%d:%d:%d:%d:") % request.maxcorrections()
+            % request.escalate() % request.ranked() % options.sorted() % limit)
+        + request.word();
 }
 
-IndexSearch::~IndexSearch()
+indexer::query_cache::result_ptr pimpl<indexer::IndexSearch>::implementation::search(
+        indexer::index& index, const indexer::WordQuery& request, size_t limit)
 {
+    using namespace indexer;
+    auto result = boost::make_shared<query_cache::result_t>();
+    size_t k = request.escalate() && !request.ranked() ? 0 : request.maxcorrections();
+    for (;;) {
+        index::timing_t timing;
+        if (request.ranked()) {
+            index::matches_t matches;
+            result->truncated = index.search_closest(request.word(), k, true, matches,
+                    limit, request.escalate(), &timing);
+            // Only the closest matches were kept
+            if (request.escalate() && !matches.empty())
+                k = matches.front().distance;
+            for (auto& match : matches) {
+                result->keys.push_back(std::move(match.key));
+                result->distances.push_back(match.distance);
+            }
+        } else {
+            result->truncated = index.search(request.word(), k, true, result->keys, limit,
+                    request.options().sorted(), &timing);
+        }
+        metrics.record(query_metrics::FORWARD_SEARCH, k, timing.forward_us);
+        if (k != 0) {
+            metrics.record(query_metrics::REVERSE_SEARCH, k, timing.reverse_us);
+            metrics.record(query_metrics::MERGE, k, timing.merge_us);
+        }
+        if (!result->keys.empty() || k >= static_cast<size_t>(request.maxcorrections()))
+            break;
+        ++k;
+    }
+    result->k = k;
+    result->corrections = result->distances.empty() ? k : result->distances.front();
+    return result;
 }
 
-void IndexSearch::useStore(const UseStore& request, rpcz::reply<Void> reply)
+void pimpl<indexer::IndexSearch>::implementation::run_query(indexer::store const& store,
+        const indexer::WordQuery& request, indexer::QueryResult& pb_results)
 {
-    implementation& impl = **this;
-    try {
-        std::cout << "Got useStore request: '" << request.DebugString() << "'" << std::endl;
+    using namespace indexer;
+    stopwatch total;
+    auto cache = store.cache();
+    IndexSearch::check_query(request);
+    QueryOptions const& options = request.options();
+    size_t offset = options.offset();
+    size_t limit = options.limit();
 
-        impl.store = impl.store_mgr->open(request.location());
+    // Taken first, so that nothing read from a store changing meanwhile is cached
+    query_cache::generation_t generation = cache->generation();
+    std::string key = cache_key(request, offset + limit);
+    query_cache::result_ptr result = cache->find_result(key);
+    if (!result) {
+        result = search(*store.index(), request, offset + limit);
+        cache->insert_result(key, result, generation);
+    }
+    size_t k = result->k;
+    std::vector<std::string> const& results = result->keys;
+    pb_results.set_exact_total(results.size());
+    pb_results.set_truncated(result->truncated);
+    pb_results.set_corrections(result->corrections);
 
-    } RPC_REPORT_EXCEPTIONS(reply)
-    reply.send(Void());
+    offset = std::min(offset, results.size());
+    bool keys_only = options.keysonly();
+    std::vector<std::string> values;
+    if (!keys_only) {
+        stopwatch fetch;
+        values.resize(results.size() - offset);
+        std::vector<size_t> missing;
+        std::vector<std::string> missing_keys;
+        for (size_t i = offset; i < results.size(); ++i) {
+            auto value = cache->find_value(results[i]);
+            if (value) {
+                values[i - offset] = std::move(*value);
+            } else {
+                missing.push_back(i - offset);
+                missing_keys.push_back(results[i]);
+            }
+        }
+        if (!missing.empty()) {
+            auto fetched = store.db()->multi_get(store.terms()->find(missing_keys));
+            for (size_t i = 0; i < missing.size(); ++i) {
+                cache->insert_value(missing_keys[i], fetched[i], generation);
+                values[missing[i]] = std::move(fetched[i]);
+            }
+        }
+        metrics.record(query_metrics::VALUE_FETCH, k, fetch.elapsed_us());
+    }
+    stopwatch serialize;
+    for (size_t i = offset; i < results.size(); ++i) {
+        IndexRecord* record = pb_results.add_values();
+        record->set_key(results[i]);
+        if (!result->distances.empty())
+            record->set_corrections(result->distances[i]);
+        if (!keys_only) {
+            record->mutable_value()->ParseFromString(values[i - offset]);
+        } else {
+            record->mutable_value()->Clear();
+        }
+    }
+    metrics.record(query_metrics::SERIALIZE, k, serialize.elapsed_us());
+    metrics.record(query_metrics::TOTAL, k, total.elapsed_us());
 }
 
-void IndexSearch::wordQuery(const WordQuery& request, rpcz::reply<QueryResult> reply)
+void pimpl<indexer::IndexSearch>::implementation::prefix_query(
+        const indexer::PrefixQuery& request, rpcz::reply<indexer::QueryResult> reply)
 {
-    implementation& impl = **this;
+    using namespace indexer;
     try {
-        if (!impl.store)
+        stopwatch total;
+        auto store = open_store();
+        QueryOptions const& options = request.options();
+        if (options.limit() < 0 || options.offset() < 0)
             BOOST_THROW_EXCEPTION(common_exception()
-                << errinfo_rpc_code(::rpc_error::INVALID_STORE)
-                << errinfo_message("Store is not open"));
+                << errinfo_rpc_code(::rpc_error::INVALID_ARGUMENT)
+                << errinfo_message("Negative limit or offset"));
+        size_t offset = options.offset();
+        size_t limit = options.limit();
 
-        std::cout << "Searching for '" << request.word() << "', k=" << request.maxcorrections() << std::endl;
-        auto index = impl.store->index();
-        auto db = impl.store->db();
-        ::indexer::index::results_t results;
-        index->search(request.word(), request.maxcorrections(), true, results);
-        bool keys_only = request.options().keysonly();
+        // One more than asked for tells whether there are more
+        index::completions_t completions;
+        if (!store->index()->complete(request.prefix(), offset + limit + 1, completions))
+            BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_rpc_code(::rpc_error::OPERATION_NOT_SUPPORTED)
+                << errinfo_message("Prefix queries need a built index, call buildIndex first"));
         QueryResult pb_results;
-        pb_results.set_exact_total(results.size());
-        for (std::string const& result : results) {
+        pb_results.set_truncated(completions.size() > offset + limit);
+        if (completions.size() > offset + limit)
+            completions.resize(offset + limit);
+        pb_results.set_exact_total(completions.size());
+        completions.erase(completions.begin(),
+                completions.begin() + std::min(offset, completions.size()));
+
+        std::vector<std::string> values;
+        if (!options.keysonly()) {
+            auto terms = store->terms();
+            std::vector<term_id> ids;
+            for (auto const& completion : completions)
+                ids.push_back(terms->find(completion.key).get_value_or(NO_TERM));
+            values = store->db()->multi_get(ids);
+        }
+        for (size_t i = 0; i < completions.size(); ++i) {
             IndexRecord* record = pb_results.add_values();
-            std::cout << "  result: " << result << std::endl;
-            record->set_key(result);
-            if (!keys_only) {
-                std::string const& s = db->get(result);
-                record->mutable_value()->ParseFromString(s);
-            } else {
+            record->set_key(completions[i].key);
+            record->set_weight(completions[i].weight);
+            if (!options.keysonly())
+                record->mutable_value()->ParseFromString(values[i]);
+            else
                 record->mutable_value()->Clear();
-            }
         }
+        metrics.record(query_metrics::PREFIX_SEARCH, 0, total.elapsed_us());
         reply.send(pb_results);
     } RPC_REPORT_EXCEPTIONS(reply)
 }
 
+void pimpl<indexer::IndexSearch>::implementation::get_stats(
+        rpcz::reply<indexer::SearchStats> reply)
+{
+    using namespace indexer;
+    SearchStats stats;
+    for (int stage = 0; stage < query_metrics::STAGES; ++stage) {
+        for (size_t k = 0; k <= query_metrics::MAX_K; ++k) {
+            auto snapshot = metrics.histogram(query_metrics::stage_t(stage), k).snapshot();
+            if (snapshot.count == 0)
+                continue;
+            StageLatency* latency = stats.add_stages();
+            latency->set_stage(query_metrics::stage_name(query_metrics::stage_t(stage)));
+            latency->set_k(k);
+            latency->set_count(snapshot.count);
+            latency->set_total_us(snapshot.total_us);
+            latency->set_max_us(snapshot.max_us);
+            latency->set_p50_us(snapshot.percentile(0.5));
+            latency->set_p90_us(snapshot.percentile(0.9));
+            latency->set_p99_us(snapshot.percentile(0.99));
+            // Trailing empty buckets are left out
+            size_t used = snapshot.buckets.size();
+            while (used != 0 && snapshot.buckets[used - 1] == 0)
+                --used;
+            for (size_t i = 0; i < used; ++i)
+                latency->add_buckets(snapshot.buckets[i]);
+        }
+    }
+
+    store_manager::store_ptr current;
+    {
+        boost::lock_guard<boost::mutex> lock(store_mutex);
+        current = store;
+    }
+    if (current) {
+        auto caches = current->cache()->stats();
+        auto add_level = [&stats](char const* name, query_cache::level_stats_t const& level) {
+            CacheStats* cache = stats.add_caches();
+            cache->set_level(name);
+            cache->set_hits(level.hits);
+            cache->set_misses(level.misses);
+            uint64_t lookups = level.hits + level.misses;
+            cache->set_hit_rate(lookups ? double(level.hits) / lookups : 0.);
+            cache->set_inserts(level.inserts);
+            cache->set_evictions(level.evictions);
+            cache->set_invalidations(level.invalidations);
+            cache->set_entries(level.entries);
+            cache->set_bytes(level.bytes);
+            cache->set_capacity(level.capacity);
+        };
+        add_level("results", caches.results);
+        add_level("values", caches.values);
+    }
+    reply.send(stats);
 }
 
+void pimpl<indexer::IndexSearch>::implementation::word_query(const indexer::WordQuery& request,
+        rpcz::reply<indexer::QueryResult> reply)
+{
+    using namespace indexer;
+    try {
+        QueryResult pb_results;
+        run_query(*open_store(), request, pb_results);
+        reply.send(pb_results);
+    } RPC_REPORT_EXCEPTIONS(reply)
+}
+
+void pimpl<indexer::IndexSearch>::implementation::batch_query(const indexer::BatchQuery& request,
+        rpcz::reply<indexer::BatchQueryResult> reply)
+{
+    using namespace indexer;
+    try {
+        auto store = open_store();
+        BatchQueryResult pb_results;
+        for (WordQuery const& query : request.queries())
+            run_query(*store, query, *pb_results.add_results());
+        reply.send(pb_results);
+    } RPC_REPORT_EXCEPTIONS(reply)
+}
+
+namespace indexer {
+
+IndexSearch::options_t::options_t()
+    : workers(4)
+    , max_in_flight(256)
+{
+}
+
+IndexSearch::IndexSearch(boost::shared_ptr<store_manager> const& store_mgr,
+        options_t const& options)
+    : base(store_mgr, options)
+{
+}
+
+IndexSearch::~IndexSearch()
+{
+}
+
+void IndexSearch::check_query(const WordQuery& request)
+{
+    QueryOptions const& options = request.options();
+    if (options.limit() < 0 || options.offset() < 0)
+        BOOST_THROW_EXCEPTION(common_exception()
+            << errinfo_rpc_code(::rpc_error::INVALID_ARGUMENT)
+            << errinfo_message("Negative limit or offset"));
+    // Escalating queries walk once for every k up to it
+    if (request.maxcorrections() < 0
+            || static_cast<size_t>(request.maxcorrections()) > index::MAX_CORRECTIONS)
+        BOOST_THROW_EXCEPTION(common_exception()
+            << errinfo_rpc_code(::rpc_error::INVALID_ARGUMENT)
+            << errinfo_message(str(boost::format("maxCorrections must be within 0..%d")
+                    % index::MAX_CORRECTIONS)));
+}
+
+void IndexSearch::useStore(const UseStore& request, rpcz::reply<Void> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<Void> reply) {
+        impl.use_store(request, reply);
+    });
+}
+
+void IndexSearch::wordQuery(const WordQuery& request, rpcz::reply<QueryResult> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<QueryResult> reply) {
+        impl.word_query(request, reply);
+    });
+}
+
+void IndexSearch::batchQuery(const BatchQuery& request, rpcz::reply<BatchQueryResult> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<BatchQueryResult> reply) {
+        impl.batch_query(request, reply);
+    });
+}
+
+void IndexSearch::prefixQuery(const PrefixQuery& request, rpcz::reply<QueryResult> reply)
+{
+    implementation& impl = **this;
+    impl.dispatcher.dispatch(reply, [&impl, request](rpcz::reply<QueryResult> reply) {
+        impl.prefix_query(request, reply);
+    });
+}
+
+// Answered on the rpcz thread, so that it is not queued behind searches
+void IndexSearch::getStats(const Void& request, rpcz::reply<SearchStats> reply)
+{
+    (*this)->get_stats(reply);
+}
+
+}
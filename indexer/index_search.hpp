@@ -14,12 +14,29 @@ struct IndexSearch
     , public boost::noncopyable
     , private pimpl<IndexSearch>::pointer_semantics
 {
-    IndexSearch(boost::shared_ptr<store_manager> const& store_mgr);
+    struct options_t
+    {
+        options_t();
+
+        // Threads handling requests, 0 to handle them on the rpcz thread
+        size_t workers;
+        // Requests queued or running, the rest are rejected with SERVER_BUSY
+        size_t max_in_flight;
+    };
+
+    IndexSearch(boost::shared_ptr<store_manager> const& store_mgr,
+            options_t const& options = options_t());
     virtual ~IndexSearch();
 
+    // Throws INVALID_ARGUMENT for word queries that cannot be served
+    static void check_query(const WordQuery& request);
+
 private:
     virtual void useStore(const UseStore& request, rpcz::reply<Void> reply);
     virtual void wordQuery(const WordQuery& request, rpcz::reply<QueryResult> reply);
+    virtual void batchQuery(const BatchQuery& request, rpcz::reply<BatchQueryResult> reply);
+    virtual void getStats(const Void& request, rpcz::reply<SearchStats> reply);
+    virtual void prefixQuery(const PrefixQuery& request, rpcz::reply<QueryResult> reply);
 };
 
 }
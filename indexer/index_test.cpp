@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "index.hpp"
+#include "fuzzy_processor.hpp"
+
+namespace fs = boost::filesystem;
+
+// Pages of a truncated search, each asked for with offset + limit the way
+// wordQuery does, have to follow one another without gaps or overlaps.
+
+static size_t failures = 0;
+
+static void check(bool ok, std::string const& what)
+{
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static void check_paging(indexer::index& idx, std::string const& name,
+        std::string const& word, size_t k, bool sorted, size_t page)
+{
+    std::string what = name + " '" + word + "' k=" + std::to_string(k) +
+        (sorted ? " sorted" : " unsorted") + " page " + std::to_string(page);
+
+    indexer::index::results_t all;
+    check(!idx.search(word, k, true, all, std::numeric_limits<size_t>::max(), sorted),
+            what + ": unlimited search is not truncated");
+    check(all.size() > page, what + ": enough matches to page through");
+    check(std::set<std::string>(all.begin(), all.end()).size() == all.size(),
+            what + ": no duplicates");
+
+    indexer::index::results_t paged;
+    for (size_t offset = 0; ; offset += page) {
+        indexer::index::results_t results;
+        bool truncated = idx.search(word, k, true, results, offset + page, sorted);
+        check(results.size() <= offset + page, what + ": no more than offset + limit");
+        check(truncated == (offset + page < all.size()),
+                what + ": truncated at offset " + std::to_string(offset));
+        if (results.size() <= offset)
+            break;
+        paged.insert(paged.end(), results.begin() + offset, results.end());
+        if (!truncated)
+            break;
+    }
+    check(paged == all, what + ": pages make up the whole result");
+}
+
+// Closest matches are those of the first k that has any
+static void check_closest(indexer::index& idx, std::string const& name,
+        std::string const& word, size_t limit)
+{
+    std::string what = name + " closest '" + word + "' limit " + std::to_string(limit);
+
+    indexer::index::results_t expected;
+    size_t k = 0;
+    while (expected.empty() && k <= 2)
+        idx.search(word, k++, true, expected);
+    indexer::index::matches_t matches;
+    bool truncated = idx.search_closest(word, 2, true, matches, limit, true);
+    check(truncated == (expected.size() > limit), what + ": truncated");
+    if (expected.size() > limit)
+        expected.resize(limit);
+    indexer::index::results_t keys;
+    for (auto const& m : matches) {
+        keys.push_back(m.key);
+        check(m.distance == k - 1, what + ": distance of " + m.key);
+    }
+    check(keys == expected, what + ": keys");
+}
+
+// Every match up to k=2, closest first and then by key. Split walks also
+// find keys only a transposition at the split brings within k, they are
+// not matches.
+static void check_ranked(indexer::index& idx, std::string const& name,
+        std::string const& word, size_t limit)
+{
+    std::string what = name + " ranked '" + word + "' limit " + std::to_string(limit);
+
+    indexer::index::results_t keys;
+    idx.search(word, 2, true, keys, std::numeric_limits<size_t>::max(), true);
+    fuzzy_processor proc(word + '\xFF', 2, true);
+    indexer::index::matches_t expected;
+    for (std::string const& key : keys) {
+        size_t dist;
+        if (proc.check(key + '\xFF', true, &dist))
+            expected.push_back(indexer::index::match{ key, dist });
+    }
+    std::stable_sort(expected.begin(), expected.end(),
+            [](indexer::index::match const& a, indexer::index::match const& b) {
+                return a.distance < b.distance;
+            });
+    indexer::index::matches_t matches;
+    bool truncated = idx.search_closest(word, 2, true, matches, limit);
+    check(truncated == (expected.size() > limit), what + ": truncated");
+    if (expected.size() > limit)
+        expected.resize(limit);
+    check(matches.size() == expected.size(), what + ": size");
+    for (size_t i = 0; i < std::min(matches.size(), expected.size()); ++i) {
+        check(matches[i].key == expected[i].key, what + ": key " + expected[i].key);
+        check(matches[i].distance == expected[i].distance,
+                what + ": distance of " + expected[i].key);
+    }
+}
+
+// Keys without weights are completed in key order
+static void check_complete(indexer::index& idx, std::string const& name)
+{
+    indexer::index::completions_t completions;
+    check(idx.complete("ab", 20, completions), name + ": completes from frozen images");
+    check(completions.size() == 20, name + ": completions up to the limit");
+    for (size_t i = 1; i < completions.size(); ++i)
+        check(completions[i - 1].key < completions[i].key, name + ": completions by key");
+}
+
+static void check_index(indexer::index& idx, std::string const& name)
+{
+    for (size_t limit : { 1, 5, 1000 }) {
+        check_closest(idx, name, "abcab", limit);
+        check_closest(idx, name, "abcdabcd", limit);
+        check_ranked(idx, name, "abcab", limit);
+        check_ranked(idx, name, "abcdabcd", limit);
+        // Too long for the fixed processors
+        check_ranked(idx, name, std::string(129, 'a') + "b", limit);
+    }
+    for (bool sorted : { true, false }) {
+        for (size_t page : { 1, 7, 50 }) {
+            check_paging(idx, name, "abcab", 2, sorted, page);
+            check_paging(idx, name, "ba", 2, sorted, page);
+            check_paging(idx, name, "a", 2, sorted, page);
+        }
+    }
+}
+
+int main()
+{
+    fs::path dir = fs::temp_directory_path() / fs::unique_path("index_test_%%%%%%%%");
+
+    // Short words over few letters, so that k=2 matches a lot of them
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> length(1, 7), letter(0, 3);
+    std::set<std::string> words;
+    while (words.size() < 3000) {
+        std::string word;
+        for (int i = length(rng); i > 0; --i)
+            word += char('a' + letter(rng));
+        words.insert(word);
+    }
+    words.insert(std::string(130, 'a'));
+    words.insert(std::string(128, 'a') + "ba");
+    words.insert(std::string(129, 'a') + "b");
+
+    indexer::index::options_t options;
+    options.trie.part_initial_size = 1 << 20;
+    {
+        indexer::index idx(dir / "live", options);
+        for (std::string const& word : words)
+            idx.insert(word);
+        check_index(idx, "live");
+        indexer::index::completions_t completions;
+        check(!idx.complete("ab", 20, completions), "live: no completions before a freeze");
+        idx.freeze();
+        check_index(idx, "frozen");
+        check_complete(idx, "frozen");
+    }
+    {
+        // A frozen base and published deltas
+        options.snapshots = true;
+        indexer::index idx(dir / "snapshots", options);
+        size_t fed = 0;
+        for (std::string const& word : words) {
+            idx.insert(word);
+            if (++fed == words.size() / 2)
+                idx.freeze();
+            else if (fed % 300 == 0)
+                idx.publish();
+        }
+        idx.publish();
+        check_index(idx, "snapshots");
+        check_complete(idx, "snapshots");
+    }
+
+    fs::remove_all(dir);
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
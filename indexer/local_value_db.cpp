@@ -0,0 +1,84 @@
+#include "local_value_db.hpp"
+
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "stagedb.hpp"
+
+namespace fs = boost::filesystem;
+
+using boost::string_ref;
+
+template <>
+struct pimpl<indexer::local_value_db>::implementation
+{
+    implementation(fs::path const& path)
+        : db(path, false)
+    {}
+
+    stage_db db;
+    // stage_db keeps a single write batch
+    boost::mutex write_mutex;
+};
+
+namespace indexer {
+
+namespace {
+
+struct local_transaction
+    : public value_db::transaction
+{
+    local_transaction(pimpl<local_value_db>::implementation& impl)
+        : impl(impl)
+    {}
+
+    void append(term_id key, string_ref const& data)
+    {
+        objects[key].append(data.begin(), data.end());
+    }
+
+    void rollback()
+    {
+        objects.clear();
+    }
+
+    void commit()
+    {
+        boost::lock_guard<boost::mutex> lock(impl.write_mutex);
+        // Values of a key are merged first, stage_db::append does not see
+        // its own uncommitted writes
+        for (auto const& p : objects)
+            impl.db.append(term_key(p.first), p.second);
+        try {
+            impl.db.commit();
+        } catch (...) {
+            impl.db.rollback();
+            throw;
+        }
+        objects.clear();
+    }
+
+private:
+    pimpl<local_value_db>::implementation& impl;
+    std::unordered_map<term_id, std::string> objects;
+};
+
+}
+
+local_value_db::local_value_db(fs::path const& path)
+    : base(path)
+{
+}
+
+std::string local_value_db::get(term_id key) const
+{
+    return (*this)->db.get(term_key(key));
+}
+
+std::unique_ptr<value_db::transaction> local_value_db::start_tx()
+{
+    return std::unique_ptr<value_db::transaction>(new local_transaction(**this));
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "pimpl/pimpl.h"
+#include <boost/filesystem.hpp>
+
+#include "value_db.hpp"
+
+namespace indexer {
+
+// Postings kept next to the index in a stage_db
+struct local_value_db
+    : public value_db
+    , private pimpl<local_value_db>::pointer_semantics
+{
+    local_value_db(boost::filesystem::path const& path);
+
+    std::string get(term_id key) const;
+    std::unique_ptr<value_db::transaction> start_tx();
+};
+
+}
@@ -15,6 +15,22 @@ int main(int argc, const char** argv) {
             "set MongoDB URL for the value_db")
         ("mongodb-db", po::value<std::string>()->default_value("index"), 
             "set MongoDB database name for the value_db")
+        ("search-threads", po::value<size_t>()->default_value(0),
+            "set number of threads for parallel fuzzy search, 0 to disable")
+        ("build-threads", po::value<size_t>()->default_value(0),
+            "set number of threads for parallel bulk index build, 0 to disable")
+        ("query-workers", po::value<size_t>()->default_value(4),
+            "set number of threads handling search requests, 0 to handle them on the rpcz thread")
+        ("max-in-flight", po::value<size_t>()->default_value(256),
+            "set number of search requests queued or running before new ones are rejected")
+        ("ingest-queue", po::value<size_t>()->default_value(64),
+            "set number of pipelined feedData batches queued before new ones are rejected")
+        ("query-cache-mb", po::value<size_t>()->default_value(64),
+            "set megabytes of cached search results per store, 0 to disable")
+        ("value-cache-mb", po::value<size_t>()->default_value(256),
+            "set megabytes of cached values per store, 0 to disable")
+        ("snapshots", po::value<bool>()->default_value(false),
+            "set to serve searches from snapshots published per feed batch instead of locking")
         ;
     
     po::variables_map vm;
@@ -36,12 +52,22 @@ int main(int argc, const char** argv) {
     indexer::store_manager::options_t opts;
     opts.mongodb_url = vm["mongodb-url"].as<std::string>();
     opts.mongodb_name = vm["mongodb-db"].as<std::string>();
+    opts.search_threads = vm["search-threads"].as<size_t>();
+    opts.build_threads = vm["build-threads"].as<size_t>();
+    opts.cache.query_bytes = vm["query-cache-mb"].as<size_t>() << 20;
+    opts.cache.value_bytes = vm["value-cache-mb"].as<size_t>() << 20;
+    opts.snapshots = vm["snapshots"].as<bool>();
     auto store_mgr = boost::make_shared<indexer::store_manager>(opts);
 
-    indexer::IndexBuilder index_builder_service(store_mgr);
+    indexer::IndexBuilder::options_t builder_opts;
+    builder_opts.ingest_queue = vm["ingest-queue"].as<size_t>();
+    indexer::IndexBuilder index_builder_service(store_mgr, builder_opts);
     server.register_service(&index_builder_service);
 
-    indexer::IndexSearch index_search_service(store_mgr);
+    indexer::IndexSearch::options_t search_opts;
+    search_opts.workers = vm["query-workers"].as<size_t>();
+    search_opts.max_in_flight = vm["max-in-flight"].as<size_t>();
+    indexer::IndexSearch index_search_service(store_mgr, search_opts);
     server.register_service(&index_search_service);
 
     std::cout << "Serving requests on port 5555." << std::endl;
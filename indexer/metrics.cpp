@@ -0,0 +1,87 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+
+namespace indexer {
+
+const size_t latency_histogram::BUCKETS;
+const size_t latency_histogram::SHARDS;
+const size_t query_metrics::MAX_K;
+
+latency_histogram::snapshot_t::snapshot_t()
+    : count(0), total_us(0), max_us(0), buckets(BUCKETS)
+{
+}
+
+uint64_t latency_histogram::snapshot_t::percentile(double q) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i + 1 < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::min(uint64_t(1) << i, max_us);
+    }
+    return max_us;
+}
+
+latency_histogram::latency_histogram()
+{
+    for (shard& s : shards_) {
+        s.count = 0;
+        s.total_us = 0;
+        s.max_us = 0;
+        for (auto& bucket : s.buckets)
+            bucket = 0;
+    }
+}
+
+void latency_histogram::record(uint64_t us)
+{
+    // Threads are spread over shards in the order they first record
+    static std::atomic<size_t> next_shard(0);
+    static thread_local size_t shard_idx = next_shard++ % SHARDS;
+
+    size_t bucket = 0;
+    while (bucket + 1 < BUCKETS && us >= (uint64_t(1) << bucket))
+        ++bucket;
+
+    shard& s = shards_[shard_idx];
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.total_us.fetch_add(us, std::memory_order_relaxed);
+    s.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = s.max_us.load(std::memory_order_relaxed);
+    while (us > max && !s.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed))
+        ;
+}
+
+latency_histogram::snapshot_t latency_histogram::snapshot() const
+{
+    snapshot_t result;
+    for (shard const& s : shards_) {
+        result.count += s.count.load(std::memory_order_relaxed);
+        result.total_us += s.total_us.load(std::memory_order_relaxed);
+        result.max_us = std::max(result.max_us, s.max_us.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < BUCKETS; ++i)
+            result.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+char const* query_metrics::stage_name(stage_t stage)
+{
+    switch (stage) {
+        case FORWARD_SEARCH: return "forward_search";
+        case REVERSE_SEARCH: return "reverse_search";
+        case MERGE: return "merge";
+        case VALUE_FETCH: return "value_fetch";
+        case SERIALIZE: return "serialize";
+        case TOTAL: return "total";
+        case PREFIX_SEARCH: return "prefix_search";
+        default: return "unknown";
+    }
+}
+
+}
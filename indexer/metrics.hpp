@@ -0,0 +1,128 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace indexer {
+
+struct stopwatch
+{
+    typedef std::chrono::steady_clock clock;
+
+    stopwatch()
+        : start_(clock::now())
+    {}
+
+    uint64_t elapsed_us() const
+    { return elapsed<std::chrono::microseconds>(); }
+
+    uint64_t elapsed_ns() const
+    { return elapsed<std::chrono::nanoseconds>(); }
+
+    // Return the time since the last lap or the start
+    uint64_t lap_us()
+    { return lap<std::chrono::microseconds>(); }
+
+    uint64_t lap_ns()
+    { return lap<std::chrono::nanoseconds>(); }
+
+private:
+    template <typename Unit>
+    uint64_t elapsed() const
+    { return std::chrono::duration_cast<Unit>(clock::now() - start_).count(); }
+
+    template <typename Unit>
+    uint64_t lap()
+    {
+        auto now = clock::now();
+        uint64_t result = std::chrono::duration_cast<Unit>(now - start_).count();
+        start_ = now;
+        return result;
+    }
+
+    clock::time_point start_;
+};
+
+// Latency histogram with power of two buckets. Threads are spread over
+// SHARDS shards, round-robin as they first record, so threads beyond that
+// share them. Shards take relaxed atomics and are only summed by snapshot().
+struct latency_histogram
+    : public boost::noncopyable
+{
+    // Bucket i counts samples below 2^i us, the last one also the rest
+    static const size_t BUCKETS = 32;
+    static const size_t SHARDS = 16;
+
+    struct snapshot_t
+    {
+        snapshot_t();
+
+        // Upper bound of the bucket holding the q-th quantile
+        uint64_t percentile(double q) const;
+
+        uint64_t count;
+        uint64_t total_us;
+        uint64_t max_us;
+        std::vector<uint64_t> buckets;
+    };
+
+    latency_histogram();
+
+    void record(uint64_t us);
+    snapshot_t snapshot() const;
+
+private:
+    struct shard
+    {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total_us;
+        std::atomic<uint64_t> max_us;
+        std::atomic<uint64_t> buckets[BUCKETS];
+        // Keeps neighbouring shards off each other's cache lines
+        char padding[64];
+    };
+
+    shard shards_[SHARDS];
+};
+
+// Search latencies by stage and number of corrections
+struct query_metrics
+    : public boost::noncopyable
+{
+    enum stage_t
+    {
+        FORWARD_SEARCH,
+        REVERSE_SEARCH,
+        MERGE,
+        VALUE_FETCH,
+        SERIALIZE,
+        TOTAL,
+        // The whole of a prefix query, always with k = 0
+        PREFIX_SEARCH,
+        STAGES
+    };
+
+    // Larger k are counted with MAX_K
+    static const size_t MAX_K = 4;
+
+    static char const* stage_name(stage_t stage);
+
+    void record(stage_t stage, size_t k, uint64_t us)
+    {
+        histograms_[stage][std::min<size_t>(k, MAX_K)].record(us);
+    }
+
+    latency_histogram const& histogram(stage_t stage, size_t k) const
+    {
+        return histograms_[stage][k];
+    }
+
+private:
+    latency_histogram histograms_[STAGES][MAX_K + 1];
+};
+
+}
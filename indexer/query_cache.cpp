@@ -0,0 +1,269 @@
+#include "query_cache.hpp"
+
+#include <atomic>
+#include <list>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+using boost::string_ref;
+
+namespace {
+
+typedef indexer::query_cache::generation_t generation_t;
+
+// Rough cost of an entry besides its key and value
+static const size_t ENTRY_OVERHEAD = 96;
+static const size_t SHARDS = 16;
+
+struct string_ref_hash
+{
+    size_t operator()(string_ref const& s) const
+    { return boost::hash_range(s.begin(), s.end()); }
+};
+
+template <typename Value>
+struct lru_level
+{
+    struct entry
+    {
+        std::string key;
+        Value value;
+        size_t bytes;
+        generation_t generation;
+    };
+
+    struct shard
+    {
+        shard()
+            : bytes(0)
+        {}
+
+        // Most recently used first, the map points into the keys
+        std::list<entry> entries;
+        boost::unordered_map<string_ref, typename std::list<entry>::iterator,
+            string_ref_hash> map;
+        size_t bytes;
+        boost::mutex mutex;
+    };
+
+    lru_level(size_t capacity)
+        : capacity(capacity), shard_capacity(capacity / SHARDS)
+        , hits(0), misses(0), inserts(0), evictions(0), invalidations(0)
+    {}
+
+    shard& shard_of(string_ref const& key)
+    {
+        return shards[string_ref_hash()(key) % SHARDS];
+    }
+
+    // Entries older than oldest are stale
+    bool find(std::string const& key, generation_t oldest, Value& result)
+    {
+        if (capacity == 0)
+            return false;
+        shard& s = shard_of(key);
+        boost::lock_guard<boost::mutex> lock(s.mutex);
+        auto it = s.map.find(string_ref(key));
+        if (it == s.map.end()) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (it->second->generation < oldest) {
+            drop(s, it->second);
+            invalidations.fetch_add(1, std::memory_order_relaxed);
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        s.entries.splice(s.entries.begin(), s.entries, it->second);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        result = it->second->value;
+        return true;
+    }
+
+    // Skipped if the store changed since generation was taken
+    void insert(std::string const& key, Value const& value, size_t value_bytes,
+            generation_t generation, std::atomic<generation_t> const& current)
+    {
+        size_t bytes = key.size() + value_bytes + ENTRY_OVERHEAD;
+        if (bytes > shard_capacity)
+            return;
+        shard& s = shard_of(key);
+        boost::lock_guard<boost::mutex> lock(s.mutex);
+        if (generation != current.load())
+            return;
+        auto it = s.map.find(string_ref(key));
+        if (it != s.map.end())
+            drop(s, it->second);
+        s.entries.push_front(entry{ key, value, bytes, generation });
+        s.map.emplace(string_ref(s.entries.front().key), s.entries.begin());
+        s.bytes += bytes;
+        inserts.fetch_add(1, std::memory_order_relaxed);
+        while (s.bytes > shard_capacity) {
+            drop(s, --s.entries.end());
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void erase(std::string const& key)
+    {
+        if (capacity == 0)
+            return;
+        shard& s = shard_of(key);
+        boost::lock_guard<boost::mutex> lock(s.mutex);
+        auto it = s.map.find(string_ref(key));
+        if (it == s.map.end())
+            return;
+        drop(s, it->second);
+        invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void clear()
+    {
+        for (shard& s : shards) {
+            boost::lock_guard<boost::mutex> lock(s.mutex);
+            invalidations.fetch_add(s.entries.size(), std::memory_order_relaxed);
+            s.map.clear();
+            s.entries.clear();
+            s.bytes = 0;
+        }
+    }
+
+    indexer::query_cache::level_stats_t stats()
+    {
+        indexer::query_cache::level_stats_t result;
+        result.hits = hits.load(std::memory_order_relaxed);
+        result.misses = misses.load(std::memory_order_relaxed);
+        result.inserts = inserts.load(std::memory_order_relaxed);
+        result.evictions = evictions.load(std::memory_order_relaxed);
+        result.invalidations = invalidations.load(std::memory_order_relaxed);
+        result.capacity = capacity;
+        for (shard& s : shards) {
+            boost::lock_guard<boost::mutex> lock(s.mutex);
+            result.entries += s.entries.size();
+            result.bytes += s.bytes;
+        }
+        return result;
+    }
+
+private:
+    void drop(shard& s, typename std::list<entry>::iterator it)
+    {
+        s.map.erase(string_ref(it->key));
+        s.bytes -= it->bytes;
+        s.entries.erase(it);
+    }
+
+    size_t capacity;
+    size_t shard_capacity;
+    shard shards[SHARDS];
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> inserts;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> invalidations;
+};
+
+}
+
+template <>
+struct pimpl<indexer::query_cache>::implementation
+{
+    implementation(indexer::query_cache::options_t const& options)
+        : generation(0), results(options.query_bytes), values(options.value_bytes)
+    {}
+
+    std::atomic<generation_t> generation;
+    mutable lru_level<indexer::query_cache::result_ptr> results;
+    mutable lru_level<std::string> values;
+};
+
+namespace indexer {
+
+query_cache::options_t::options_t()
+    : query_bytes(64 << 20)
+    , value_bytes(256 << 20)
+{
+}
+
+query_cache::level_stats_t::level_stats_t()
+    : hits(0), misses(0), inserts(0), evictions(0), invalidations(0)
+    , entries(0), bytes(0), capacity(0)
+{
+}
+
+query_cache::query_cache(options_t const& options)
+    : base(options)
+{
+}
+
+query_cache::generation_t query_cache::generation() const
+{
+    return (*this)->generation.load();
+}
+
+query_cache::result_ptr query_cache::find_result(std::string const& query) const
+{
+    implementation const& impl = **this;
+    result_ptr result;
+    impl.results.find(query, impl.generation.load(), result);
+    return result;
+}
+
+void query_cache::insert_result(std::string const& query, result_ptr const& result,
+        generation_t generation)
+{
+    implementation& impl = **this;
+    size_t bytes = sizeof(result_t) + result->distances.size() * sizeof(size_t);
+    for (std::string const& key : result->keys)
+        bytes += sizeof(std::string) + key.size();
+    impl.results.insert(query, result, bytes, generation, impl.generation);
+}
+
+boost::optional<std::string> query_cache::find_value(std::string const& key) const
+{
+    implementation const& impl = **this;
+    std::string value;
+    // Values are dropped by key, their generation doesn't matter
+    if (!impl.values.find(key, 0, value))
+        return boost::none;
+    return value;
+}
+
+void query_cache::insert_value(std::string const& key, std::string const& value,
+        generation_t generation)
+{
+    implementation& impl = **this;
+    impl.values.insert(key, value, value.size(), generation, impl.generation);
+}
+
+void query_cache::invalidate(std::vector<std::string> const& keys)
+{
+    implementation& impl = **this;
+    // Inserts racing with the keys being dropped see the new generation
+    ++impl.generation;
+    for (std::string const& key : keys)
+        impl.values.erase(key);
+}
+
+void query_cache::clear()
+{
+    implementation& impl = **this;
+    ++impl.generation;
+    impl.results.clear();
+    impl.values.clear();
+}
+
+query_cache::stats_t query_cache::stats() const
+{
+    implementation const& impl = **this;
+    stats_t result;
+    result.results = impl.results.stats();
+    result.values = impl.values.stats();
+    return result;
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "pimpl/pimpl.h"
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace indexer {
+
+// Caches of a store's search results and serialized values, both LRU
+// bounded by bytes and split into shards with their own locks.
+//
+// Results are tagged with the generation they were computed in and every
+// change of the store starts a new one, so older results are never
+// returned. Values are dropped by key when their term is fed.
+struct query_cache
+    : private pimpl<query_cache>::pointer_semantics
+    , public boost::noncopyable
+{
+    struct options_t
+    {
+        options_t();
+
+        // 0 turns a level off
+        size_t query_bytes;
+        size_t value_bytes;
+    };
+
+    query_cache(options_t const& options = options_t());
+
+    typedef uint64_t generation_t;
+
+    // Keys of a search before offset is applied
+    struct result_t
+    {
+        std::vector<std::string> keys;
+        // Only known for ranked searches
+        std::vector<size_t> distances;
+        bool truncated;
+        // k the keys were found with and the corrections reported
+        size_t k;
+        size_t corrections;
+    };
+    typedef boost::shared_ptr<result_t const> result_ptr;
+
+    // Taken before a search or fetch, so that results computed from a store
+    // that changed meanwhile are not cached
+    generation_t generation() const;
+
+    result_ptr find_result(std::string const& query) const;
+    void insert_result(std::string const& query, result_ptr const& result,
+            generation_t generation);
+
+    boost::optional<std::string> find_value(std::string const& key) const;
+    void insert_value(std::string const& key, std::string const& value,
+            generation_t generation);
+
+    // Called once a change is visible in the store, drops all results and
+    // the values of the given keys
+    void invalidate(std::vector<std::string> const& keys = std::vector<std::string>());
+    void clear();
+
+    struct level_stats_t
+    {
+        level_stats_t();
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t evictions;
+        // Entries dropped by invalidate() or found stale
+        uint64_t invalidations;
+        uint64_t entries;
+        uint64_t bytes;
+        uint64_t capacity;
+    };
+    struct stats_t
+    {
+        level_stats_t results;
+        level_stats_t values;
+    };
+    stats_t stats() const;
+};
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <boost/format.hpp>
+#include <boost/shared_ptr.hpp>
+#include <rpcz/rpcz.hpp>
+
+#include "executor.hpp"
+#include "exceptions.hpp"
+
+namespace indexer {
+
+// Moves RPC handlers off the rpcz thread onto a worker pool. Requests over
+// the in-flight limit are rejected right away with SERVER_BUSY.
+struct request_dispatcher
+    : public boost::noncopyable
+{
+    request_dispatcher(size_t workers, size_t max_in_flight)
+        : max_in_flight_(max_in_flight)
+        , in_flight_(0)
+        , workers_(workers ? new executor(workers) : nullptr)
+    {}
+
+    // Handler is called as handler(reply) on a worker and has to complete the
+    // reply itself, exceptions are reported through it
+    template <typename Reply, typename Handler>
+    void dispatch(Reply reply, Handler handler)
+    {
+        if (!workers_) {
+            run(reply, handler);
+            return;
+        }
+        if (++in_flight_ > max_in_flight_) {
+            --in_flight_;
+            reply.Error(::rpc_error::SERVER_BUSY, str(boost::format(
+                            "Too many requests in flight, limit is %d") % max_in_flight_));
+            return;
+        }
+        workers_->submit([this, reply, handler] {
+            run(reply, handler);
+            --in_flight_;
+        });
+    }
+
+private:
+    template <typename Reply, typename Handler>
+    static void run(Reply reply, Handler const& handler)
+    {
+        try {
+            handler(reply);
+        } RPC_REPORT_EXCEPTIONS(reply)
+    }
+
+    size_t max_in_flight_;
+    std::atomic<size_t> in_flight_;
+    // Destroyed first, queued requests still use the counter
+    boost::shared_ptr<executor> workers_;
+};
+
+}
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+
+#include "exceptions.hpp"
+#include "index_search.hpp"
+
+// Word queries the server cannot serve are rejected before any walk
+
+static size_t failures = 0;
+
+static void check(bool ok, std::string const& what)
+{
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// Returns the RPC code check_query() failed with, 0 if it passed
+static int check_query(int max_corrections, bool escalate, int limit = 10, int offset = 0)
+{
+    indexer::WordQuery query;
+    query.set_word("word");
+    query.set_maxcorrections(max_corrections);
+    query.set_escalate(escalate);
+    query.mutable_options()->set_limit(limit);
+    query.mutable_options()->set_offset(offset);
+    try {
+        indexer::IndexSearch::check_query(query);
+    } catch (common_exception const& e) {
+        int const* code = boost::get_error_info<errinfo_rpc_code>(e);
+        return code ? *code : rpc_error::UNKNOWN_ERROR;
+    }
+    return 0;
+}
+
+int main()
+{
+    for (bool escalate : { false, true }) {
+        std::string mode = escalate ? " escalating" : "";
+        check(check_query(0, escalate) == 0, "k=0" + mode + " accepted");
+        check(check_query(7, escalate) == 0, "k=7" + mode + " accepted");
+        check(check_query(-1, escalate) == rpc_error::INVALID_ARGUMENT,
+                "k=-1" + mode + " rejected");
+        check(check_query(8, escalate) == rpc_error::INVALID_ARGUMENT,
+                "k=8" + mode + " rejected");
+        check(check_query(1 << 30, escalate) == rpc_error::INVALID_ARGUMENT,
+                "huge k" + mode + " rejected");
+    }
+    check(check_query(1, false, -1) == rpc_error::INVALID_ARGUMENT, "negative limit rejected");
+    check(check_query(1, false, 10, -1) == rpc_error::INVALID_ARGUMENT,
+            "negative offset rejected");
+
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -40,16 +40,18 @@ stage_db::stage_db(fs::path const& path, bool read_only)
     impl.db.reset(raw_db);
 }
 
-std::string stage_db::get(string_ref const& key)
+std::string stage_db::get(string_ref const& key) const
 {
-    implementation& impl = **this;
+    implementation const& impl = **this;
 
     std::string data;
     leveldb::Status s = impl.db->Get(leveldb::ReadOptions(), as_slice(key), &data);
+    if (s.IsNotFound())
+        return std::string();
     if (!s.ok()) {
         BOOST_THROW_EXCEPTION(common_exception()
                 << errinfo_rpc_code(::rpc_error::INVALID_STORE)
-                << errinfo_message(std::string("Error while reading db, key = ") + key.begin()));
+                << errinfo_message("Error while reading db, key = " + std::string(key)));
     }
     return data;
 }
@@ -77,7 +79,43 @@ void stage_db::append(string_ref const& key, string_ref const& value, bool trans
     if (!s.ok()) {
         BOOST_THROW_EXCEPTION(common_exception()
                 << errinfo_rpc_code(::rpc_error::INVALID_STORE)
-                << errinfo_message(std::string("Error while writing to db, key = ") + key.begin()));
+                << errinfo_message("Error while writing to db, key = " + std::string(key)));
+    }
+}
+
+void stage_db::put(string_ref const& key, string_ref const& value, bool transacted)
+{
+    implementation& impl = **this;
+
+    if (transacted) {
+        impl.batch.Put(as_slice(key), as_slice(value));
+        return;
+    }
+    leveldb::Status s = impl.db->Put(leveldb::WriteOptions(), as_slice(key), as_slice(value));
+    if (!s.ok()) {
+        BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                << errinfo_message("Error while writing to db, key = " + std::string(key)));
+    }
+}
+
+void stage_db::scan(string_ref const& prefix,
+        std::function<void (string_ref const&, string_ref const&)> const& f) const
+{
+    implementation const& impl = **this;
+
+    std::unique_ptr<leveldb::Iterator> it(impl.db->NewIterator(leveldb::ReadOptions()));
+    for (it->Seek(as_slice(prefix)); it->Valid(); it->Next()) {
+        leveldb::Slice key = it->key();
+        if (!key.starts_with(as_slice(prefix)))
+            break;
+        leveldb::Slice value = it->value();
+        f(string_ref(key.data(), key.size()), string_ref(value.data(), value.size()));
+    }
+    if (!it->status().ok()) {
+        BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                << errinfo_message("Error while scanning db"));
     }
 }
 
@@ -4,6 +4,7 @@
 #include <boost/noncopyable.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/utility/string_ref.hpp>
+#include <functional>
 
 struct stage_db
     : private pimpl<stage_db>::pointer_semantics
@@ -11,10 +12,17 @@ struct stage_db
 {
     stage_db(boost::filesystem::path const& path, bool read_only = true);
 
-    std::string get(boost::string_ref const& key);
+    // Returns an empty string for missing keys
+    std::string get(boost::string_ref const& key) const;
 
     void append(boost::string_ref const& key, boost::string_ref const& data,
             bool transacted = true);
+    // Overwrites the value without reading the old one
+    void put(boost::string_ref const& key, boost::string_ref const& data,
+            bool transacted = true);
+    // Calls f for every committed key starting with prefix, in byte order
+    void scan(boost::string_ref const& prefix,
+            std::function<void (boost::string_ref const& key, boost::string_ref const& data)> const& f) const;
     void rollback();
     void commit();
 };
@@ -8,8 +8,15 @@
 #include <boost/unordered_map.hpp>
 #include <boost/weak_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 #include "exceptions.hpp"
+#include "executor.hpp"
+#include "local_value_db.hpp"
 
 namespace fs = boost::filesystem;
 namespace io = boost::iostreams;
@@ -19,14 +26,37 @@ namespace rpc_error {
 
 namespace indexer {
 
-static const int STORE_FORMAT = 1;
+static const int STORE_FORMAT = 5;
 
 }
 
 template <>
 struct pimpl<indexer::store>::implementation
 {
-    void do_create_store(const indexer::StoreParameters& request) {
+    // Term IDs are dense in every store, so each MongoDB store keeps its
+    // postings in a collection of its own, named after the store ID
+    static std::string postings_ns(indexer::store::options_t const& options,
+            std::string const& id) {
+        return options.mongodb_name + ".postings." + id;
+    }
+
+    // Drops the postings of the store at location if they are in MongoDB
+    static void drop_postings(fs::path const& location,
+            indexer::store::options_t const& options) {
+        if (!fs::exists(location / "id") || !fs::exists(location / "info"))
+            return;
+        indexer::IndexFormat format;
+        fs::ifstream store_info(location / "info", std::ios::binary);
+        if (!format.ParseFromIstream(&store_info) ||
+                format.value_storage() != indexer::IndexFormat::MONGODB)
+            return;
+        std::string id;
+        fs::ifstream(location / "id") >> id;
+        indexer::mongo_value_db::drop(options.mongodb_url, postings_ns(options, id));
+    }
+
+    void do_create_store(const indexer::StoreParameters& request,
+            indexer::store::options_t const& options) {
         fs::path location = request.location();
         if (fs::is_directory(location)) {
             if (!request.overwrite()) {
@@ -37,6 +67,7 @@ struct pimpl<indexer::store>::implementation
                 std::cout << "Recreating store at " << location << std::endl;
                 if (this->index)
                     this->index.reset();
+                drop_postings(location, options);
                 fs::remove_all(location);
             }
         } else {
@@ -51,9 +82,15 @@ struct pimpl<indexer::store>::implementation
         io::stream<io::file_sink> store_info((location / "info").string());
         request.format().SerializeToOstream(&store_info);
         store_info.close();
+
+        fs::ofstream store_id(location / "id");
+        store_id << boost::uuids::random_generator()();
+        store_id.close();
+        // Nothing may be left from an earlier store of the same ID
+        drop_postings(location, options);
     }
 
-    void do_open_store(fs::path const& location) {
+    void do_open_store(fs::path const& location, indexer::store::options_t const& options) {
         if (!fs::exists(location / "format")) {
             BOOST_THROW_EXCEPTION(common_exception()
                     << errinfo_rpc_code(::rpc_error::STORE_NOT_FOUND)
@@ -73,13 +110,52 @@ struct pimpl<indexer::store>::implementation
                             % location % format % indexer::STORE_FORMAT)));
         }
 
-        this->index.reset(new indexer::index(location / "index"));
-        this->db.reset(new indexer::value_db("localhost", "index.postings"));
-
         io::stream<io::file_source> store_info((location / "info").string());
         this->format.ParseFromIstream(&store_info);
         store_info.close();
 
+        indexer::index::options_t index_options = options.index;
+        index_options.trie.part_initial_size = this->format.part_initial_size();
+        index_options.trie.part_size_limit = this->format.part_size_limit();
+        index_options.trie.part_grow_factor = this->format.part_grow_factor();
+        index_options.trie.part_free_factor = this->format.part_free_factor();
+        index_options.bulk_build = this->format.bulk_build();
+        if (index_options.trie.part_initial_size == 0 ||
+                index_options.trie.part_grow_factor <= 1. ||
+                index_options.trie.part_free_factor < 0. ||
+                index_options.trie.part_free_factor >= 1.) {
+            BOOST_THROW_EXCEPTION(common_exception()
+                    << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                    << errinfo_message(str(boost::format("Store at %s has invalid "
+                                "part sizing parameters") % location)));
+        }
+
+        this->terms.reset(new indexer::term_dict(location / "terms"));
+        auto terms = this->terms;
+        index_options.weight = [terms](boost::string_ref const& key) {
+            return terms->weight(key);
+        };
+        this->index.reset(new indexer::index(location / "index", index_options));
+        switch (this->format.value_storage()) {
+        case indexer::IndexFormat::LOCAL:
+            this->db.reset(new indexer::local_value_db(location / "values"));
+            break;
+        case indexer::IndexFormat::MONGODB: {
+            std::string id;
+            fs::ifstream(location / "id") >> id;
+            if (id.empty()) {
+                BOOST_THROW_EXCEPTION(common_exception()
+                        << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                        << errinfo_message(str(boost::format("Store at %s has no ID")
+                                % location)));
+            }
+            this->db.reset(new indexer::mongo_value_db(options.mongodb_url,
+                        postings_ns(options, id)));
+            break;
+        }
+        }
+
+        this->cache.reset(new indexer::query_cache(options.cache));
         this->store_root = location;
     }
 
@@ -90,6 +166,8 @@ struct pimpl<indexer::store>::implementation
     indexer::IndexFormat format;
     boost::shared_ptr<indexer::index> index;
     boost::shared_ptr<indexer::value_db> db;
+    boost::shared_ptr<indexer::term_dict> terms;
+    boost::shared_ptr<indexer::query_cache> cache;
 };
 
 template <>
@@ -97,23 +175,37 @@ struct pimpl<indexer::store_manager>::implementation
 {
     implementation(indexer::store_manager::options_t const& options)
         : options(options)
-    {}
+    {
+        store_options.mongodb_url = options.mongodb_url;
+        store_options.mongodb_name = options.mongodb_name;
+        store_options.cache = options.cache;
+        store_options.index.snapshots = options.snapshots;
+        if (options.search_threads != 0)
+            store_options.index.search_executor = boost::make_shared<indexer::executor>(
+                    options.search_threads);
+        if (options.build_threads != 0)
+            store_options.index.build_executor = boost::make_shared<indexer::executor>(
+                    options.build_threads);
+    }
 
     indexer::store_manager::options_t options;
+    indexer::store::options_t store_options;
     boost::unordered_map<fs::path, boost::weak_ptr<indexer::store>> stores;
+    // Builder and search services open stores from their own workers
+    boost::mutex mutex;
 };
 
 namespace indexer {
 
-store::store(const StoreParameters& parameters)
+store::store(const StoreParameters& parameters, options_t const& options)
 {
-    (*this)->do_create_store(parameters);
-    (*this)->do_open_store(fs::path(parameters.location()));
+    (*this)->do_create_store(parameters, options);
+    (*this)->do_open_store(fs::path(parameters.location()), options);
 }
 
-store::store(fs::path const& location)
+store::store(fs::path const& location, options_t const& options)
 {
-    (*this)->do_open_store(location);
+    (*this)->do_open_store(location, options);
 }
 
 store::~store()
@@ -136,6 +228,16 @@ boost::shared_ptr<value_db> store::db() const
     return (*this)->db;
 }
 
+boost::shared_ptr<term_dict> store::terms() const
+{
+    return (*this)->terms;
+}
+
+boost::shared_ptr<query_cache> store::cache() const
+{
+    return (*this)->cache;
+}
+
 store_manager::store_manager(options_t const& options)
     : base(options)
 {
@@ -148,6 +250,7 @@ store_manager::~store_manager()
 store_manager::store_ptr store_manager::create(const StoreParameters& parameters)
 {
     implementation& impl = **this;
+    boost::lock_guard<boost::mutex> lock(impl.mutex);
     auto it = impl.stores.find(parameters.location());
     if (it != impl.stores.end()) {
         auto store = it->second.lock();
@@ -155,7 +258,7 @@ store_manager::store_ptr store_manager::create(const StoreParameters& parameters
             return store;
         }
     }
-    auto result = boost::make_shared<store>(parameters);
+    auto result = boost::make_shared<store>(parameters, impl.store_options);
     impl.stores[parameters.location()] = result;
     return result;
 }
@@ -163,6 +266,7 @@ store_manager::store_ptr store_manager::create(const StoreParameters& parameters
 store_manager::store_ptr store_manager::open(fs::path const& location)
 {
     implementation& impl = **this;
+    boost::lock_guard<boost::mutex> lock(impl.mutex);
     auto it = impl.stores.find(location);
     if (it != impl.stores.end()) {
         auto store = it->second.lock();
@@ -170,7 +274,7 @@ store_manager::store_ptr store_manager::open(fs::path const& location)
             return store;
         }
     }
-    auto result = boost::make_shared<store>(location);
+    auto result = boost::make_shared<store>(location, impl.store_options);
     impl.stores[location] = result;
     return result;
 }
@@ -7,19 +7,33 @@
 #include "pimpl/pimpl.h"
 #include "index.hpp"
 #include "value_db.hpp"
+#include "query_cache.hpp"
 
 namespace indexer {
 
 struct store final
     : private pimpl<store>::pointer_semantics
 {
-    store(StoreParameters const& parameters);
-    store(boost::filesystem::path const& location);
+    struct options_t
+    {
+        // Part sizing is overridden by the store format
+        ::indexer::index::options_t index;
+        ::indexer::query_cache::options_t cache;
+        std::string mongodb_url;
+        std::string mongodb_name;
+    };
+
+    store(StoreParameters const& parameters, options_t const& options);
+    store(boost::filesystem::path const& location, options_t const& options);
     ~store();
 
     boost::filesystem::path location() const;
     boost::shared_ptr< ::indexer::index> index() const;
     boost::shared_ptr< ::indexer::value_db> db() const;
+    // IDs of indexed terms, postings in db() are keyed by them
+    boost::shared_ptr<term_dict> terms() const;
+    // Search results and values, shared by the services using the store
+    boost::shared_ptr<query_cache> cache() const;
 };
 
 struct store_manager final
@@ -30,6 +44,14 @@ struct store_manager final
     {
         std::string mongodb_url;
         std::string mongodb_name;
+        // Threads shared by fuzzy searches of all stores, 0 to search sequentially
+        size_t search_threads;
+        // Threads bulk loading key ranges of a store, 0 to load sequentially
+        size_t build_threads;
+        // Cache capacities of every store
+        ::indexer::query_cache::options_t cache;
+        // Searches read published snapshots instead of locking out feeds
+        bool snapshots;
     };
 
     store_manager(options_t const& options);
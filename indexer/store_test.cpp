@@ -0,0 +1,109 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "store_manager.hpp"
+#include "term_dict.hpp"
+
+namespace fs = boost::filesystem;
+
+// Stores of the same server get term IDs from 0 each, their values must
+// still stay apart. MongoDB stores are only checked if INDEX_TEST_MONGODB
+// names a server to use.
+
+static size_t failures = 0;
+
+static void check(bool ok, std::string const& what)
+{
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static indexer::store_manager::store_ptr create(indexer::store_manager& manager,
+        fs::path const& location, indexer::IndexFormat::ValueStorage storage,
+        bool overwrite = false)
+{
+    indexer::StoreParameters parameters;
+    parameters.set_location(location.string());
+    parameters.mutable_format()->set_value_storage(storage);
+    parameters.mutable_format()->set_part_initial_size(1 << 20);
+    parameters.set_overwrite(overwrite);
+    return manager.create(parameters);
+}
+
+// Feeds every word with its store's tag as value, the way feedData does
+static void feed(indexer::store& target, std::vector<std::string> const& words,
+        std::string const& tag)
+{
+    auto terms = target.terms();
+    auto tx = target.db()->start_tx();
+    for (std::string const& word : words) {
+        tx->append(terms->assign(word), tag + word);
+        target.index()->insert(word);
+    }
+    terms->commit();
+    tx->commit();
+}
+
+static std::string value(indexer::store& target, std::string const& word)
+{
+    auto id = target.terms()->find(word);
+    return id ? target.db()->get(*id) : std::string();
+}
+
+static void check_stores(indexer::store_manager& manager, fs::path const& dir,
+        indexer::IndexFormat::ValueStorage storage, std::string const& name)
+{
+    auto a = create(manager, dir / (name + "_a"), storage);
+    auto b = create(manager, dir / (name + "_b"), storage);
+    feed(*a, { "apple", "pear" }, "a:");
+    feed(*b, { "zebra", "yak" }, "b:");
+    check(a->terms()->find("apple") == b->terms()->find("zebra"),
+            name + ": first terms share their ID");
+    check(value(*a, "apple") == "a:apple", name + ": apple of store a");
+    check(value(*a, "pear") == "a:pear", name + ": pear of store a");
+    check(value(*b, "zebra") == "b:zebra", name + ": zebra of store b");
+    check(value(*b, "yak") == "b:yak", name + ": yak of store b");
+
+    // Recreated stores start empty, values are not appended to old ones
+    fs::path location = a->location();
+    a.reset();
+    a = create(manager, location, storage, true);
+    feed(*a, { "plum" }, "c:");
+    check(value(*a, "plum") == "c:plum", name + ": plum of recreated store a");
+    check(!a->terms()->find("apple"), name + ": apple gone from recreated store a");
+    check(value(*b, "zebra") == "b:zebra", name + ": zebra of store b after recreation");
+}
+
+int main()
+{
+    fs::path dir = fs::temp_directory_path() / fs::unique_path("store_test_%%%%%%%%");
+    fs::create_directories(dir);
+
+    indexer::store_manager::options_t options;
+    options.search_threads = 0;
+    options.build_threads = 0;
+    options.snapshots = true;
+    options.mongodb_name = "store_test";
+    {
+        indexer::store_manager manager(options);
+        check_stores(manager, dir, indexer::IndexFormat::LOCAL, "local");
+    }
+    if (char const* url = std::getenv("INDEX_TEST_MONGODB")) {
+        options.mongodb_url = url;
+        indexer::store_manager manager(options);
+        check_stores(manager, dir, indexer::IndexFormat::MONGODB, "mongodb");
+    }
+
+    fs::remove_all(dir);
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+#include "term_dict.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "stagedb.hpp"
+#include "exceptions.hpp"
+
+namespace fs = boost::filesystem;
+
+using boost::string_ref;
+
+namespace {
+
+struct string_ref_hash
+{
+    size_t operator()(string_ref const& s) const
+    { return boost::hash_range(s.begin(), s.end()); }
+};
+
+}
+
+template <>
+struct pimpl<indexer::term_dict>::implementation
+{
+    implementation(fs::path const& path)
+        : db(path, false)
+    {
+        db.scan("i", [this](string_ref const& key, string_ref const& data) {
+            if (indexer::parse_term_key(key.substr(1)) != terms.size())
+                BOOST_THROW_EXCEPTION(common_exception()
+                        << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                        << errinfo_message("Term dictionary has gaps"));
+            add(data);
+        });
+        // Weights use the same fixed-size encoding as IDs
+        db.scan("w", [this](string_ref const& key, string_ref const& data) {
+            indexer::term_id id = indexer::parse_term_key(key.substr(1));
+            if (id >= terms.size())
+                BOOST_THROW_EXCEPTION(common_exception()
+                        << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                        << errinfo_message("Weight of an unknown term"));
+            weights[id] = indexer::parse_term_key(data);
+        });
+    }
+
+    indexer::term_id add(string_ref const& term)
+    {
+        terms.emplace_back(term.begin(), term.end());
+        indexer::term_id id = terms.size() - 1;
+        ids.emplace(string_ref(terms.back()), id);
+        weights.push_back(0);
+        return id;
+    }
+
+    stage_db db;
+    // Strings of a deque never move, the map points into them
+    std::deque<std::string> terms;
+    boost::unordered_map<string_ref, indexer::term_id, string_ref_hash> ids;
+    std::deque<uint32_t> weights;
+    mutable boost::shared_mutex mutex;
+};
+
+namespace indexer {
+
+std::string term_key(term_id id)
+{
+    std::string result(sizeof(id), '\0');
+    for (size_t i = 0; i < sizeof(id); ++i)
+        result[i] = static_cast<char>(id >> (8 * (sizeof(id) - 1 - i)));
+    return result;
+}
+
+term_id parse_term_key(string_ref const& key)
+{
+    if (key.size() != sizeof(term_id))
+        BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_rpc_code(::rpc_error::INVALID_STORE)
+                << errinfo_message("Invalid term key"));
+    term_id result = 0;
+    for (char c : key)
+        result = (result << 8) | static_cast<uint8_t>(c);
+    return result;
+}
+
+term_dict::term_dict(fs::path const& path)
+    : base(path)
+{
+}
+
+term_id term_dict::assign(string_ref const& term)
+{
+    implementation& impl = **this;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+        auto it = impl.ids.find(term);
+        if (it != impl.ids.end())
+            return it->second;
+    }
+    boost::unique_lock<boost::shared_mutex> lock(impl.mutex);
+    auto it = impl.ids.find(term);
+    if (it != impl.ids.end())
+        return it->second;
+    if (impl.terms.size() == NO_TERM)
+        BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_message("Term IDs exhausted"));
+    term_id id = impl.add(term);
+    impl.db.put("i" + term_key(id), term);
+    return id;
+}
+
+void term_dict::commit()
+{
+    implementation& impl = **this;
+    boost::unique_lock<boost::shared_mutex> lock(impl.mutex);
+    impl.db.commit();
+}
+
+boost::optional<term_id> term_dict::find(string_ref const& term) const
+{
+    implementation const& impl = **this;
+    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+    auto it = impl.ids.find(term);
+    if (it == impl.ids.end())
+        return boost::none;
+    return it->second;
+}
+
+std::vector<term_id> term_dict::find(std::vector<std::string> const& terms) const
+{
+    implementation const& impl = **this;
+    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+    std::vector<term_id> result;
+    result.reserve(terms.size());
+    for (std::string const& term : terms) {
+        auto it = impl.ids.find(string_ref(term));
+        result.push_back(it == impl.ids.end() ? NO_TERM : it->second);
+    }
+    return result;
+}
+
+std::string term_dict::term(term_id id) const
+{
+    implementation const& impl = **this;
+    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+    if (id >= impl.terms.size())
+        return std::string();
+    return impl.terms[id];
+}
+
+size_t term_dict::size() const
+{
+    implementation const& impl = **this;
+    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+    return impl.terms.size();
+}
+
+void term_dict::add_weight(term_id id, uint32_t weight)
+{
+    implementation& impl = **this;
+    boost::unique_lock<boost::shared_mutex> lock(impl.mutex);
+    if (id >= impl.terms.size())
+        BOOST_THROW_EXCEPTION(common_exception()
+                << errinfo_message("Unknown term ID"));
+    uint32_t& current = impl.weights[id];
+    current += std::min(weight, std::numeric_limits<uint32_t>::max() - current);
+    impl.db.put("w" + term_key(id), term_key(current));
+}
+
+uint32_t term_dict::weight(term_id id) const
+{
+    implementation const& impl = **this;
+    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+    return id < impl.weights.size() ? impl.weights[id] : 0;
+}
+
+uint32_t term_dict::weight(string_ref const& term) const
+{
+    implementation const& impl = **this;
+    boost::shared_lock<boost::shared_mutex> lock(impl.mutex);
+    auto it = impl.ids.find(term);
+    return it == impl.ids.end() ? 0 : impl.weights[it->second];
+}
+
+}
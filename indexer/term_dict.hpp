@@ -0,0 +1,50 @@
+#pragma once
+
+#include "pimpl/pimpl.h"
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace indexer {
+
+typedef uint32_t term_id;
+
+static const term_id NO_TERM = std::numeric_limits<term_id>::max();
+
+// Dense IDs of the terms of a store, assigned in insertion order, and their
+// weights. The whole dictionary is kept in memory and persisted in a stage_db.
+struct term_dict
+    : private pimpl<term_dict>::pointer_semantics
+    , public boost::noncopyable
+{
+    term_dict(boost::filesystem::path const& path);
+
+    // Returns the ID of the term, a new one if it is not known yet.
+    // New IDs are persisted by commit().
+    term_id assign(boost::string_ref const& term);
+    void commit();
+
+    boost::optional<term_id> find(boost::string_ref const& term) const;
+    // IDs in the order of terms, NO_TERM for unknown ones
+    std::vector<term_id> find(std::vector<std::string> const& terms) const;
+    std::string term(term_id id) const;
+    size_t size() const;
+
+    // Weights rank completions, e.g. by document frequency. They saturate
+    // and are persisted by commit().
+    void add_weight(term_id id, uint32_t weight);
+    uint32_t weight(term_id id) const;
+    // 0 for unknown terms
+    uint32_t weight(boost::string_ref const& term) const;
+};
+
+// Fixed-size big-endian key, so that IDs sort numerically in byte order
+std::string term_key(term_id id);
+term_id parse_term_key(boost::string_ref const& key);
+
+}
@@ -1,12 +1,18 @@
 #include "trie.hpp"
 
 #include <memory>
+#include <atomic>
 #include <iostream>
+#include <cstring>
+#include <limits>
 
 #include <boost/variant.hpp>
 #include <boost/optional.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/range/algorithm.hpp>
+#include <boost/range/numeric.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <boost/container/vector.hpp>
 #include <boost/container/string.hpp>
 #include <boost/interprocess/offset_ptr.hpp>
@@ -18,11 +24,14 @@
 #include <boost/interprocess/allocators/cached_adaptive_pool.hpp>
 #include <boost/interprocess/allocators/adaptive_pool.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/format.hpp>
 #include <boost/filesystem/fstream.hpp>
 
 #include "trie_layout.hpp"
-#include "fuzzy_processor.hpp"
+#include "trie_search.hpp"
+#include "frozen_trie_layout.hpp"
+#include "executor.hpp"
 
 namespace fs = ::boost::filesystem;
 namespace cont = ::boost::container;
@@ -30,57 +39,6 @@ namespace ipc = ::boost::interprocess;
 
 using boost::string_ref;
 
-template <typename RangeT>
-string_ref as_ref(RangeT const& range)
-{
-    return string_ref(::boost::begin(range), ::boost::size(range));
-}
-
-template<typename Range1T, typename Range2T, typename PredicateT>
-    inline boost::iterator_range<typename boost::range_const_iterator<Range1T>::type> common_prefix(
-    const Range1T& Input,
-    const Range2T& Test,
-    PredicateT Comp)
-{
-    typedef typename
-        ::boost::range_const_iterator<Range1T>::type Iterator1T;
-    typedef typename
-        ::boost::range_const_iterator<Range2T>::type Iterator2T;
-
-    ::boost::iterator_range<Iterator1T> lit_input(::boost::as_literal(Input));
-    ::boost::iterator_range<Iterator2T> lit_test(::boost::as_literal(Test));
-
-    Iterator1T InputEnd=::boost::end(lit_input);
-    Iterator2T TestEnd=::boost::end(lit_test);
-
-    Iterator1T it=::boost::begin(lit_input);
-    Iterator2T pit=::boost::begin(lit_test);
-    for(;
-        it!=InputEnd && pit!=TestEnd;
-        ++it,++pit)
-    {
-        if(!(Comp(*it,*pit)))
-            break;
-    }
-    return ::boost::iterator_range<Iterator1T>(::boost::begin(lit_input), it);
-}
-
-template<typename Range1T, typename Range2T>
-    inline boost::iterator_range<typename boost::range_const_iterator<Range1T>::type> common_prefix(
-    const Range1T& Input,
-    const Range2T& Test)
-{
-    return common_prefix(Input, Test, boost::is_equal());
-}
-
-template<typename Range1T, typename Range2T>
-    inline size_t common_prefix_length(
-    const Range1T& Input,
-    const Range2T& Test)
-{
-    return boost::size(common_prefix(Input, Test));
-}
-
 template <>
 string_ref as_ref<shared::string>(shared::string const& s)
 {
@@ -138,10 +96,10 @@ struct limited_grow_policy
 
     boost::optional<size_t> grow(size_t current_size) const 
     {
-        size_t new_size = static_cast<size_t>(grow_factor() * current_size);
-        if (new_size > limit_)
+        if (current_size >= limit_)
             return boost::none;
-        return new_size;
+        size_t new_size = static_cast<size_t>(grow_factor() * current_size);
+        return std::min(new_size, limit_);
     }
 
 private:
@@ -228,7 +186,7 @@ struct trie_part
         node_allocator_t> node_deleter_t;
     typedef ipc::unique_ptr<shared::trie_node, node_deleter_t> node_ptr_t;
 
-    node_ptr_t create_node()
+    node_ptr_t create_node(size_t reserve = 10)
     {
         if (!can_allocate_more()) {
             return node_ptr_t(nullptr, *deleter_);
@@ -240,7 +198,7 @@ struct trie_part
                         shared::trie_node(allocator_->get_segment_manager()),
                     *deleter_);
             // HACK: preallocate some space in all nodes to reduce reallocations
-            result->children.reserve(10);
+            result->children.reserve(reserve);
             return result;
         } catch (ipc::bad_alloc const&) {
             --root_->nodes_count;
@@ -277,16 +235,45 @@ struct trie_part
         return stable_offset(p.get());
     }
 
+    size_t size() const
+    {
+        return file_->get_size();
+    }
+
+    bool due_to_grow()
+    {
+        return policy_->should_grow(file_->get_size(), file_->get_free_memory());
+    }
+
+    bool can_grow()
+    {
+        size_t size = file_->get_size();
+        auto new_size = policy_->grow(size);
+        return new_size && *new_size > size;
+    }
+
     bool can_allocate_more()
     {
-        // TODO: support growing
-        if (policy_->should_grow(file_->get_size(), file_->get_free_memory())) {
-            auto new_size = policy_->grow(file_->get_size());
-            if (new_size)
-                throw std::logic_error("Part growing is not supported");
-            // New nodes should be placed elsewhere
+        // A part that is due to grow takes nodes from its reserve until
+        // grow() is called, one at its size limit is not touched any more,
+        // new nodes should be placed elsewhere
+        return !due_to_grow() || can_grow();
+    }
+
+    // Remaps the part, so every node pointer into it becomes invalid.
+    // Must only be called between operations. Forced growth ignores the
+    // free reserve, for nodes that do not fit at all.
+    bool grow(bool force = false)
+    {
+        if ((!force && !due_to_grow()) || !can_grow())
             return false;
-        }
+        size_t size = file_->get_size();
+        auto new_size = policy_->grow(size);
+        close();
+        if (!ipc::managed_mapped_file::grow(part_.string().c_str(), *new_size - size))
+            throw std::logic_error("Cannot grow part " + part_.string());
+        reopen();
+        std::cout << "Part " << part_ << " grown to " << file_->get_size() << std::endl;
         return true;
     }
 
@@ -295,8 +282,6 @@ private:
     size_t part_number_;
     grow_policy* policy_;
 
-    bool needs_grow_;
-
     boost::optional<node_allocator_t> allocator_;
     boost::optional<node_deleter_t> deleter_;
 
@@ -342,6 +327,13 @@ private:
 template <>
 struct pimpl<trie>::implementation
 {
+    // Parts written by an insert are grown before the next one
+    void note_write(trie_part* part)
+    {
+        if (part->due_to_grow())
+            parts_to_grow.insert(part->number());
+    }
+
     trie_node_ref create_node(trie_part* source)
     {
         trie_part::node_ptr_t node = source->create_node();
@@ -352,6 +344,7 @@ struct pimpl<trie>::implementation
                 node = from->create_node();
                 if (!node) {
                     ++this->current_part;
+                    ++part_switches;
                     std::cout << "Switching current part to " << this->current_part << std::endl;
                 }
             }
@@ -436,24 +429,10 @@ struct pimpl<trie>::implementation
 
     std::pair<shared::trie_node::child*, size_t> find_longest_match(shared::trie_node* node, string_ref const& s)
     {
-        size_t maxlen = 0;
-        shared::trie_node::child* match = nullptr;
-#if 1
-        for (shared::trie_node::child& child : node->children) {
-            size_t len = common_prefix_length(child.label, s);
-            if (len > maxlen) {
-                maxlen = len;
-                match = &child;
-                assert(match->label.size() >= maxlen);
-            }
-        }
-#else
-        auto it = std::upper_bound(children.begin(), children.end(), s,
-                [](string_ref const& a, shared::trie_node::child const& b) {
-                    return boost::range::lexicographical_compare(a, b.label);
-                });
-#endif
-        return std::make_pair(match, maxlen);
+        shared::trie_node::child* match = node->find_child(s[0]);
+        if (!match)
+            return std::make_pair(nullptr, 0);
+        return std::make_pair(match, common_prefix_length(match->label, s));
     }
 
     boost::optional<trie_node_ref> do_insert(trie_node_ref const& ref, string_ref const& full_str, size_t start_pos)
@@ -488,6 +467,9 @@ struct pimpl<trie>::implementation
                             return boost::range::lexicographical_compare(a, b.label);
                         });
                 children.insert(it, shared::trie_node::child(s, new_ref.part()->segment_manager()));
+                new_ref.node()->reindex();
+                note_write(new_ref.part());
+                ++keys_inserted;
 
                 ref.part()->delete_node(ref.node());
                 return new_ref;
@@ -499,6 +481,9 @@ struct pimpl<trie>::implementation
                         });
 
                 children.insert(it, shared::trie_node::child(s, ref.part()->segment_manager()));
+                ref.node()->reindex();
+                note_write(ref.part());
+                ++keys_inserted;
                 return boost::none;
             }
         }
@@ -530,185 +515,30 @@ struct pimpl<trie>::implementation
         new_ref.node()->children.push_back(shared::trie_node::child(matchRest, match_ptr, new_ref.part()->segment_manager()));
         new_ref.node()->children.push_back(shared::trie_node::child(rest, new_ref.part()->segment_manager()));
         boost::sort(new_ref.node()->children);
+        new_ref.node()->reindex();
+        note_write(new_ref.part());
 
         match->label.erase(maxlen);
         match->ptr = new_ref.ptr();
+        ++keys_inserted;
+        ++node_splits;
         return boost::none;
     }
 
-    void do_search_exact(trie_node_ref const& ref, string_ref const& full_str, size_t start_pos, trie::results_t& results)
+    static std::string part_name(size_t idx)
     {
-        string_ref s = full_str.substr(start_pos);
-        string_ref prefix = full_str.substr(0, start_pos);
-        if (s.empty()) {
-            append_result(results, full_str);
-            return;
-        }
-
-        auto const& children = ref.node()->children;
-        if (children.empty()) {
-            return;
-        }
-
-        // Find the child with the longest matching prefix
-        size_t maxlen;
-        shared::trie_node::child* match;
-        std::tie(match, maxlen) = find_longest_match(ref.node(), s);
-
-        if (maxlen == 0 || maxlen < match->label.size()) {
-            return;
-        }
-
-        string_ref rest = s.substr(maxlen);
-
-        if (rest.empty()) {
-            append_result(results, full_str);
-            return;
-        } else {
-            auto child_ref = resolve_node(match->ptr, ref.part());
-            if (child_ref.node() != nullptr) {
-                do_search_exact(child_ref, full_str, start_pos + maxlen, results);
-            }
-        }
-    }
-
-    void do_search(trie_node_ref const& ref, std::string& scrap, fuzzy_processor const& proc, 
-            fuzzy_processor::context const& ctx, bool exact_dist, trie::results_t& results,
-            size_t skip_prefix = 0)
-    {
-        for (shared::trie_node::child const& child : ref.node()->children) {
-            fuzzy_processor::context new_ctx(ctx);
-            scrap.append(child.label.begin(), child.label.end());
-
-            bool is_leaf = child.ptr == trie_node_ref::ptr_t();
-
-            size_t dist;
-            string_ref s(scrap);
-            s.remove_prefix(skip_prefix);
-            if (proc.check(s, is_leaf, &dist, &new_ctx)) {
-                if (!is_leaf) {
-                    auto child_ref = resolve_node(child.ptr, ref.part());
-                    do_search(child_ref, scrap, proc, new_ctx, exact_dist, results,
-                            skip_prefix);
-                } else if (!exact_dist || dist == proc.max_corrections()) {
-                    append_result(results, scrap);
-                }
-            }
-
-            scrap.resize(scrap.size() - child.label.size());
-        }
-    }
-
-    void do_search_semiexact(trie_node_ref const& ref, std::string& scrap,
-            string_ref const& str, size_t switch_len,
-            fuzzy_processor const& proc, fuzzy_processor::context const& ctx, bool exact_dist,
-            trie::results_t& results)
-    {
-        for (shared::trie_node::child const& child : ref.node()->children) {
-            scrap.append(child.label.begin(), child.label.end());
-            size_t step = child.label.size();
-
-            bool is_leaf = child.ptr == trie_node_ref::ptr_t();
-
-            size_t prefix = switch_len + step - scrap.size();
-            if (scrap.size() < switch_len) {
-                if (!is_leaf && str.substr(0, step) == as_ref(child.label)) {
-                    auto child_ref = resolve_node(child.ptr, ref.part());
-                    do_search_semiexact(child_ref, scrap, str.substr(step), switch_len,
-                            proc, ctx, exact_dist, results);
-                }
-            } else if (str.substr(0, prefix) == as_ref(child.label).substr(0, prefix)) {
-                fuzzy_processor::context new_ctx(ctx);
-                if (scrap.size() > switch_len) {
-                    size_t dist;
-                    if (proc.check(as_ref(child.label).substr(prefix), is_leaf,
-                                &dist, &new_ctx)) {
-                        if (!is_leaf) {
-                            auto child_ref = resolve_node(child.ptr, ref.part());
-                            do_search(child_ref, scrap, proc, new_ctx, exact_dist, results,
-                                    switch_len);
-                        } else if (!exact_dist || dist == proc.max_corrections()) {
-                            append_result(results, scrap);
-                        }
-                    }
-                } else if (!is_leaf) {
-                    auto child_ref = resolve_node(child.ptr, ref.part());
-                    do_search(child_ref, scrap, proc, new_ctx, exact_dist, results,
-                            switch_len);
-                }
-            }
-
-            scrap.resize(scrap.size() - child.label.size());
-        }
-    }
-
-    void do_search2(trie_node_ref const& ref, std::string& scrap, size_t switch_len,
-            fuzzy_processor const& proc1, fuzzy_processor::context const& ctx1,
-            bool exact_dist1, fuzzy_processor const& proc2,
-            fuzzy_processor::context const& ctx2, bool exact_dist2,
-            trie::results_t& results)
-    {
-        for (shared::trie_node::child const& child : ref.node()->children) {
-            fuzzy_processor::context new_ctx1(ctx1);
-            size_t start_pos = scrap.size();
-            scrap.append(child.label.begin(), child.label.end());
-
-            bool is_leaf = child.ptr == trie_node_ref::ptr_t();
-
-            const size_t gap = proc1.max_corrections();
-            for (; start_pos < scrap.size(); ++start_pos) {
-                if (start_pos + 1 > switch_len + gap) {
-                    break;
-                }
-                proc1.feed(scrap, new_ctx1);
-                bool final_state = false;
-                if (!proc1.query(new_ctx1, final_state)) {
-                    break;
-                }
-                if (start_pos + 1 < switch_len - gap) {
-                    continue;
-                }
-                if (final_state) {
-                    fuzzy_processor::context new_ctx2(ctx2);
-                    bool ok2 = true, final2 = false;
-                    size_t dist2;
-                    for (size_t k = start_pos + 1; k < scrap.size(); ++k) {
-                        proc2.feed(scrap[k], new_ctx2);
-                        if (!proc2.query(new_ctx2, final2, &dist2)) {
-                            ok2 = false;
-                            break;
-                        }
-                    }
-                    if (start_pos + 1 == scrap.size() || ok2) {
-                        if (!is_leaf) {
-                            auto child_ref = resolve_node(child.ptr, ref.part());
-                            do_search(child_ref, scrap, proc2, new_ctx2,
-                                    exact_dist2, results, start_pos + 1);
-                        } else if (final2 && 
-                                (!exact_dist2 || dist2 == proc2.max_corrections())) {
-                            append_result(results, scrap);
-                        }
-                    }
-                }
-            }
-
-            if (!is_leaf && start_pos == scrap.size()) {
-                auto child_ref = resolve_node(child.ptr, ref.part());
-                do_search2(child_ref, scrap, switch_len,
-                        proc1, new_ctx1, exact_dist1, proc2, ctx2, exact_dist2, results);
-            }
-
-            scrap.resize(scrap.size() - child.label.size());
-        }
+        return str(boost::format("%04u") % idx);
     }
 
     trie_part* load_part(size_t idx, bool create_if_missing = false)
     {
         if (parts.count(idx) == 0) {
-            std::string name = str(boost::format("%04u") % idx);
+            std::string name = part_name(idx);
             if (!create_if_missing && !fs::exists(part_dir / name))
                 throw std::logic_error("Part " + name + " not found in " + part_dir.string());
             std::unique_ptr<trie_part> part(new trie_part(part_dir / name, idx, part_grow_policy.get()));
+            bytes_mapped += part->size();
+            ++parts_mapped;
             parts[idx] = std::move(part);
         }
         return parts[idx].get();
@@ -734,26 +564,38 @@ struct pimpl<trie>::implementation
             throw std::logic_error("Cannot write ref " + path.string());
     }
 
-    void append_result(trie::results_t& results, boost::string_ref const& s)
+    // Parts are grown before an insert walks the trie, as the walk
+    // keeps raw node pointers
+    void grow_parts()
     {
-        // EOS hack :(
-        results.push_back(std::string(s.data(), s.size() - 1));
+        for (size_t idx : parts_to_grow)
+            grow_part(load_part(idx));
+        parts_to_grow.clear();
     }
 
-    std::string append_eos(boost::string_ref const& s)
+    bool grow_part(trie_part* part, bool force = false)
     {
-        std::string str;
-        str.reserve(s.size() + EOS.size());
-        str.append(s.begin(), s.end());
-        str += EOS;
-        return str;
+        size_t size = part->size();
+        if (!part->grow(force))
+            return false;
+        bytes_mapped += part->size() - size;
+        return true;
     }
 
-    implementation(fs::path const& part_dir)
+    implementation(fs::path const& part_dir, trie::options_t const& options)
         : part_dir(part_dir)
-        , part_grow_policy(new limited_grow_policy(1U << 28, 0.04, 2., 1U << 28)) // 256 MB starting size, 256 MB limit
+        , part_grow_policy(new limited_grow_policy(options.part_initial_size,
+                    options.part_free_factor, options.part_grow_factor,
+                    std::min<size_t>(options.part_size_limit,
+                        // external_ref offsets are 32-bit
+                        std::numeric_limits<uint32_t>::max())))
         , current_part(0)
         , head(0, 0)
+        , keys_inserted(0)
+        , node_splits(0)
+        , part_switches(0)
+        , parts_mapped(0)
+        , bytes_mapped(0)
     {
         fs::create_directories(part_dir);
         // TODO: implement real initialization step
@@ -766,28 +608,378 @@ struct pimpl<trie>::implementation
         } else {
             head = load_ref(head_path);
         }
+        // Searches run concurrently under a shared lock and must find every
+        // part loaded, only inserts add new ones
+        for (size_t idx = 0; fs::exists(part_dir / part_name(idx)); ++idx)
+            load_part(idx);
     }
 
-    static const std::string EOS;
-
     fs::path part_dir;
     std::unique_ptr<grow_policy> part_grow_policy;
     size_t current_part;
     shared::external_ref head;
     boost::unordered_map<size_t, std::unique_ptr<trie_part>> parts;
+    boost::unordered_set<size_t> parts_to_grow;
+
+    // Read without the index lock by progress reports
+    std::atomic<uint64_t> keys_inserted;
+    std::atomic<uint64_t> node_splits;
+    std::atomic<uint64_t> part_switches;
+    std::atomic<uint64_t> parts_mapped;
+    std::atomic<uint64_t> bytes_mapped;
+};
+
+namespace {
+
+struct live_tree
+{
+    typedef trie_node_ref node_ref;
+    typedef shared::trie_node::child child;
+
+    live_tree(pimpl<trie>::implementation& impl)
+        : impl(impl)
+    {}
+
+    node_ref root()
+    { return impl.resolve_external_ref(impl.head); }
+
+    decltype(shared::trie_node::children) const& children(node_ref const& ref) const
+    { return ref.node()->children; }
+
+    string_ref label(child const& c) const
+    { return as_ref(c.label); }
+
+    bool is_leaf(child const& c) const
+    { return c.ptr == trie_node_ref::ptr_t(); }
+
+    node_ref resolve(node_ref const& parent, child const& c)
+    { return impl.resolve_node(c.ptr, parent.part()); }
+
+    child const* find_child(node_ref const& ref, char c) const
+    { return ref.node()->find_child(c); }
+
+    // Part, node offset and child index, nodes hold at most 256 children
+    leaf_id leaf(node_ref const& ref, child const& c) const
+    {
+        leaf_id index = &c - &ref.node()->children[0];
+        return (leaf_id(ref.part()->number()) << 40)
+            | (leaf_id(ref.part()->stable_offset(ref.node())) << 8) | index;
+    }
+
+private:
+    pimpl<trie>::implementation& impl;
+};
+
+// Hands out fresh parts to concurrent bulk loaders, so that every part is
+// written by a single thread
+struct bulk_part_pool
+{
+    bulk_part_pool(pimpl<trie>::implementation& impl)
+        : impl(impl), next(impl.parts.size())
+    {}
+
+    trie_part* acquire()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::cout << "Bulk loading into part " << next << std::endl;
+        ++impl.part_switches;
+        return impl.load_part(next++, true);
+    }
+
+    pimpl<trie>::implementation& impl;
+    boost::mutex mutex;
+    size_t next;
 };
 
-// 0xFF is chosen because will never be in a valid UTF-8 string
-const std::string pimpl<trie>::implementation::EOS = "\xFF";
+struct bulk_child
+{
+    std::string label;
+    boost::optional<shared::external_ref> node;
+};
+
+// Builds a trie from sorted keys in one pass, see trie::bulk_load.
+//
+// Frames on the stack are the branch points along the path of the previous
+// key. The top frame's last child is the previous key's leaf, every other
+// frame is missing its last child, the frame above it, which is attached
+// once that frame is complete. Nodes are thus written bottom-up and never
+// change afterwards.
+struct trie_bulk_loader
+{
+    trie_bulk_loader(bulk_part_pool& pool, trie_part* part = nullptr)
+        : keys_count(0), pool(pool), part(part), part_empty(false)
+    {}
+
+    // Returns children of the root, which is left for the caller to write
+    std::vector<bulk_child> run(trie::key_source_t const& source)
+    {
+        stack.push_back(frame(0));
+        source([this](string_ref const& key) {
+            if (keys_count != 0) {
+                if (key == prev)
+                    return;
+                if (!boost::range::lexicographical_compare(prev, key,
+                            [](char a, char b) { return uint8_t(a) < uint8_t(b); }))
+                    throw std::logic_error("Bulk loaded keys are not sorted");
+            }
+            add(key);
+            prev.assign(key.begin(), key.end());
+            ++keys_count;
+        });
+
+        boost::optional<pending_node> pending = close_frames(0);
+        if (pending)
+            attach(stack.back(), *pending);
+        return std::move(stack.back().children);
+    }
+
+    shared::external_ref emit(std::vector<bulk_child> const& children)
+    {
+        if (!part)
+            acquire();
+        for (;;) {
+            // Nothing else points into the part yet, so it can be remapped
+            if (part->due_to_grow())
+                pool.impl.grow_part(part);
+            trie_part::node_ptr_t node = part->create_node(children.size());
+            if (node) {
+                shared::trie_node* raw = node.release().get();
+                try {
+                    fill(raw, children);
+                    part_empty = false;
+                    return shared::external_ref(part->number(), part->stable_offset(raw));
+                } catch (ipc::bad_alloc const&) {
+                    part->delete_node(raw);
+                }
+            }
+            if (pool.impl.grow_part(part, true))
+                continue;
+            if (part_empty)
+                throw std::logic_error(str(boost::format(
+                                "Node with %d children does not fit in part %d")
+                            % children.size() % part->number()));
+            acquire();
+        }
+    }
+
+    size_t keys_count;
+
+private:
+    struct frame
+    {
+        frame(size_t depth)
+            : depth(depth)
+        {}
+
+        size_t depth;
+        std::vector<bulk_child> children;
+    };
+
+    struct pending_node
+    {
+        shared::external_ref node;
+        size_t depth;
+    };
+
+    void add(string_ref const& key)
+    {
+        if (keys_count == 0) {
+            add_leaf(stack.back(), key);
+            return;
+        }
+        // No key is a prefix of another because of EOS
+        size_t lcp = common_prefix_length(prev, key);
+        assert(lcp < prev.size() && lcp < key.size());
+
+        boost::optional<pending_node> pending = close_frames(lcp);
+        frame& top = stack.back();
+        if (top.depth < lcp) {
+            frame split(lcp);
+            if (pending) {
+                attach(split, *pending);
+            } else {
+                // Move the previous leaf down
+                split.children.push_back(std::move(top.children.back()));
+                top.children.pop_back();
+                split.children.back().label.erase(0, lcp - top.depth);
+            }
+            stack.push_back(std::move(split));
+        } else if (pending) {
+            attach(top, *pending);
+        }
+        add_leaf(stack.back(), key);
+    }
+
+    // Writes all frames deeper than depth, the topmost written one is returned
+    boost::optional<pending_node> close_frames(size_t depth)
+    {
+        boost::optional<pending_node> pending;
+        while (stack.size() > 1 && stack.back().depth > depth) {
+            frame& top = stack.back();
+            if (pending)
+                attach(top, *pending);
+            pending_node node = { emit(top.children), top.depth };
+            pending = node;
+            stack.pop_back();
+        }
+        return pending;
+    }
+
+    void attach(frame& parent, pending_node const& node)
+    {
+        bulk_child child;
+        child.label = prev.substr(parent.depth, node.depth - parent.depth);
+        child.node = node.node;
+        parent.children.push_back(std::move(child));
+    }
+
+    void add_leaf(frame& parent, string_ref const& key)
+    {
+        bulk_child child;
+        child.label = std::string(key.substr(parent.depth));
+        parent.children.push_back(std::move(child));
+    }
+
+    void fill(shared::trie_node* node, std::vector<bulk_child> const& children)
+    {
+        for (bulk_child const& child : children) {
+            trie_node_ref::ptr_t ptr;
+            if (child.node) {
+                if (child.node->part_number == part->number())
+                    ptr = ipc::offset_ptr<shared::trie_node>(part->get_node(child.node->offset));
+                else
+                    ptr = *child.node;
+            }
+            node->children.push_back(shared::trie_node::child(child.label, ptr,
+                        part->segment_manager()));
+        }
+        node->reindex();
+    }
 
-trie::trie(fs::path const& path, bool read_only)
-    : base(path)
+    void acquire()
+    {
+        part = pool.acquire();
+        part_empty = true;
+    }
+
+    bulk_part_pool& pool;
+    trie_part* part;
+    // Nothing was written to the part yet, a node that does not fit it
+    // fits no other part either
+    bool part_empty;
+    std::vector<frame> stack;
+    std::string prev;
+};
+
+// Writes the trie as a frozen image, see frozen_trie_layout.hpp
+struct trie_freezer
+{
+    trie_freezer(pimpl<trie>::implementation& impl, fs::path const& image,
+            trie::weight_fn_t const& weight)
+        : impl(impl), weight(weight), file(image, std::ios::binary | std::ios::trunc)
+        , offset(sizeof(frozen::header)), nodes_count(0)
+    {
+        if (!file.good())
+            throw std::logic_error("Cannot write frozen image " + image.string());
+    }
+
+    void run()
+    {
+        frozen::header header = {};
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        header.magic = frozen::MAGIC;
+        header.version = frozen::VERSION;
+        std::string path;
+        header.root = write_node(impl.resolve_external_ref(impl.head), path).first;
+        header.nodes_count = nodes_count;
+        header.size = offset;
+        file.seekp(0);
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        file.close();
+        if (!file.good())
+            throw std::logic_error("Cannot write frozen image");
+    }
+
+private:
+    // Returns the offset of the node and the largest weight below it,
+    // path holds the key bytes leading to the node
+    std::pair<uint32_t, uint32_t> write_node(trie_node_ref const& ref, std::string& path)
+    {
+        auto const& children = ref.node()->children;
+        size_t count = children.size();
+        std::vector<uint32_t> targets(count, 0);
+        std::vector<uint32_t> weights(count, 0);
+        uint32_t max_weight = 0;
+        for (size_t i = 0; i < count; ++i) {
+            string_ref label = as_ref(children[i].label);
+            path.append(label.begin(), label.end());
+            if (!(children[i].ptr == trie_node_ref::ptr_t())) {
+                std::tie(targets[i], weights[i]) =
+                    write_node(impl.resolve_node(children[i].ptr, ref.part()), path);
+            } else if (weight) {
+                // Leaf labels end with EOS
+                weights[i] = weight(string_ref(path).substr(0, path.size() - 1));
+            }
+            path.resize(path.size() - label.size());
+            max_weight = std::max(max_weight, weights[i]);
+        }
+
+        size_t edges_pos = sizeof(uint32_t) + frozen::padded(count);
+        size_t labels_pos = edges_pos + count * sizeof(frozen::edge);
+        size_t labels_size = 0;
+        for (auto const& child : children)
+            labels_size += child.label.size();
+
+        record.assign(labels_pos + frozen::padded(labels_size), 0);
+        uint32_t count32 = count;
+        std::memcpy(&record[0], &count32, sizeof(count32));
+        size_t label_pos = labels_pos;
+        for (size_t i = 0; i < count; ++i) {
+            string_ref label = as_ref(children[i].label);
+            record[sizeof(uint32_t) + i] = label[0];
+            frozen::edge edge = { targets[i], static_cast<uint32_t>(offset + label_pos),
+                static_cast<uint32_t>(label.size()), weights[i] };
+            std::memcpy(&record[edges_pos + i * sizeof(edge)], &edge, sizeof(edge));
+            std::memcpy(&record[label_pos], label.data(), label.size());
+            label_pos += label.size();
+        }
+
+        if (offset + record.size() > std::numeric_limits<uint32_t>::max())
+            throw std::logic_error("Frozen image does not fit 32-bit offsets");
+        uint32_t result = offset;
+        file.write(record.data(), record.size());
+        offset += record.size();
+        ++nodes_count;
+        return std::make_pair(result, max_weight);
+    }
+
+    pimpl<trie>::implementation& impl;
+    trie::weight_fn_t const& weight;
+    fs::ofstream file;
+    std::string record;
+    size_t offset;
+    uint32_t nodes_count;
+};
+
+}
+
+trie::options_t::options_t()
+    : part_initial_size(1U << 26) // 64 MB
+    , part_size_limit(1U << 31) // 2 GB
+    , part_grow_factor(2.)
+    , part_free_factor(0.04)
+{
+}
+
+trie::trie(fs::path const& path, options_t const& options, bool read_only)
+    : base(path, options)
 {
 }
 
 void trie::insert(boost::string_ref const& data)
 {
     implementation& impl = **this;
+    impl.grow_parts();
     auto root = impl.resolve_external_ref(impl.head);
     auto new_head = impl.do_insert(root, data, 0);
     if (new_head) {
@@ -800,66 +992,147 @@ void trie::insert(boost::string_ref const& data)
     }
 }
 
-void trie::search_exact(boost::string_ref const& data, results_t& results)
+trie::stats_t::stats_t()
+    : keys_inserted(0)
+    , node_splits(0)
+    , part_switches(0)
+    , parts(0)
+    , bytes_mapped(0)
 {
-    implementation& impl = **this;
-    std::string pattern = impl.append_eos(data);
-    auto root = impl.resolve_external_ref(impl.head);
-    impl.do_search_exact(root, pattern, 0, results);
 }
 
-void trie::search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results)
+trie::stats_t trie::stats() const
+{
+    implementation const& impl = **this;
+    stats_t result;
+    result.keys_inserted = impl.keys_inserted;
+    result.node_splits = impl.node_splits;
+    result.part_switches = impl.part_switches;
+    result.parts = impl.parts_mapped;
+    result.bytes_mapped = impl.bytes_mapped;
+    return result;
+}
+
+bool trie::empty() const
+{
+    implementation& impl = const_cast<implementation&>(**this);
+    return impl.resolve_external_ref(impl.head).node()->children.empty();
+}
+
+void trie::bulk_load(std::vector<key_source_t> const& partitions, indexer::executor* exec)
 {
     implementation& impl = **this;
-    if (k == 0) {
-        search_exact(data, results);
-        return;
+    if (!empty())
+        throw std::logic_error("Bulk load needs an empty trie");
+
+    bulk_part_pool pool(impl);
+    std::vector<std::vector<bulk_child>> roots(partitions.size());
+    std::vector<size_t> counts(partitions.size());
+    indexer::task_group group(exec);
+    for (size_t i = 0; i < partitions.size(); ++i) {
+        group.run([&pool, &partitions, &roots, &counts, i] {
+            trie_bulk_loader loader(pool);
+            roots[i] = loader.run(partitions[i]);
+            counts[i] = loader.keys_count;
+        });
     }
+    group.wait();
+
+    // Partitions are disjoint and ordered, their roots are merged into one
+    std::vector<bulk_child> children;
+    for (auto& root : roots)
+        std::move(root.begin(), root.end(), std::back_inserter(children));
+    // The old root lives in the first part, which the new one replaces
+    auto old_root = impl.resolve_external_ref(impl.head);
+    trie_bulk_loader loader(pool, old_root.part());
+    shared::external_ref root = loader.emit(children);
+    // Parts may have been remapped while loading
+    old_root = impl.resolve_external_ref(impl.head);
+    old_root.part()->delete_node(old_root.node());
+    impl.head = root;
+    impl.save_ref(impl.part_dir / "HEAD", impl.head);
+    impl.current_part = pool.next - 1;
+    impl.keys_inserted += boost::accumulate(counts, size_t(0));
+    std::cout << "Bulk loaded " << boost::accumulate(counts, size_t(0)) << " keys in "
+        << partitions.size() << " partitions, HEAD is "
+        << impl.head.part_number << ":" << impl.head.offset << std::endl;
+}
 
-    std::string pattern = impl.append_eos(data);
-    fuzzy_processor proc(pattern, k, has_transp);
-    fuzzy_processor::context ctx(proc);
+void trie::search_exact(boost::string_ref const& data, results_t& results)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree>(tree).search_exact(data, results);
+}
 
-    auto root = impl.resolve_external_ref(impl.head);
-    std::string scrap;
-    impl.do_search(root, scrap, proc, ctx, false, results);
+bool trie::search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results,
+        size_t limit)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree> searcher(tree, limit);
+    searcher.search(data, k, has_transp, results);
+    return searcher.truncated();
 }
 
+bool trie::search_split(boost::string_ref const& data, size_t switch_len,
+        size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+        bool has_transp, results_t& results, size_t limit)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree> searcher(tree, limit);
+    searcher.search_split(data, switch_len,
+            k1, exact_dist1, k2, exact_dist2, has_transp, results);
+    return searcher.truncated();
+}
 
-void trie::search_split(boost::string_ref const& data, size_t switch_len,
+void trie::search_exact(boost::string_ref const& data, leaf_visitor_t const& visitor)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree>(tree).search_exact(data, visitor);
+}
+
+bool trie::search(boost::string_ref const& data, size_t k, bool has_transp,
+        leaf_visitor_t const& visitor, size_t limit)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree> searcher(tree, limit);
+    searcher.search(data, k, has_transp, visitor);
+    return searcher.truncated();
+}
+
+bool trie::search_split(boost::string_ref const& data, size_t switch_len,
         size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
-        bool has_transp, results_t& results)
+        bool has_transp, leaf_visitor_t const& visitor, size_t limit)
 {
-    implementation& impl = **this;
-    if (k1 == 0 && k2 == 0) {
-        search_exact(data, results);
-        return;
-    }
-    if (switch_len == 0) {
-        search(data, k1 + k2, has_transp, results);
-        return;
-    }
+    live_tree tree(**this);
+    trie_searcher<live_tree> searcher(tree, limit);
+    searcher.search_split(data, switch_len,
+            k1, exact_dist1, k2, exact_dist2, has_transp, visitor);
+    return searcher.truncated();
+}
 
-    std::string pattern = impl.append_eos(data);
-    string_ref s1 = string_ref(pattern).substr(0, switch_len);
-    string_ref s2 = string_ref(pattern).substr(switch_len);
+bool trie::search_prefix(boost::string_ref const& prefix, leaf_visitor_t const& visitor,
+        size_t limit)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree> searcher(tree, limit);
+    searcher.search_prefix(prefix, visitor);
+    return searcher.truncated();
+}
 
-    fuzzy_processor proc1(s1, k1, has_transp);
-    fuzzy_processor proc2(s2, k2, has_transp);
-    fuzzy_processor::context ctx1(proc1);
-    fuzzy_processor::context ctx2(proc2);
+bool trie::search_closest(boost::string_ref const& data, size_t k, bool has_transp,
+        ranked_visitor_t const& visitor, size_t limit)
+{
+    live_tree tree(**this);
+    trie_searcher<live_tree> searcher(tree, limit);
+    searcher.search_closest(data, k, has_transp, visitor);
+    return searcher.truncated();
+}
 
-    auto root = impl.resolve_external_ref(impl.head);
-    std::string scrap;
-    if (k1 != 0) {
-        // It is possible that s1 matches an empty string.
-        if (s1.size() == k1 || (!exact_dist1 && s1.size() < k1)) {
-            impl.do_search(root, scrap, proc2, ctx2, exact_dist2, results);
-        }
-        impl.do_search2(root, scrap, switch_len, proc1, ctx1, exact_dist1,
-                proc2, ctx2, exact_dist2, results);
-    } else {
-        impl.do_search_semiexact(root, scrap, pattern, switch_len,
-                proc2, ctx2, exact_dist2, results);
-    }
+void trie::freeze(fs::path const& image, weight_fn_t const& weight)
+{
+    fs::path tmp = image;
+    tmp += ".tmp";
+    trie_freezer freezer(**this, tmp, weight);
+    freezer.run();
+    fs::rename(tmp, image);
 }
@@ -5,19 +5,91 @@
 #include <boost/filesystem.hpp>
 #include <boost/utility/string_ref.hpp>
 #include <vector>
+#include <limits>
+
+#include "trie_leaf.hpp"
+#include <functional>
+
+namespace indexer {
+struct executor;
+}
 
 struct trie
     : private pimpl<trie>::pointer_semantics
     , public boost::noncopyable
 {
-    trie(boost::filesystem::path const& path, bool read_only = true);
+    struct options_t
+    {
+        options_t();
+
+        // Parts start at part_initial_size and are grown by part_grow_factor
+        // once less than part_free_factor of them is free, up to part_size_limit
+        size_t part_initial_size;
+        size_t part_size_limit;
+        double part_grow_factor;
+        double part_free_factor;
+    };
+
+    trie(boost::filesystem::path const& path, options_t const& options = options_t(),
+            bool read_only = true);
 
     typedef std::vector<std::string> results_t;
 
     void insert(boost::string_ref const& data);
-    void search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results);
-    void search_split(boost::string_ref const& data, size_t switch_len,
+
+    typedef std::function<void (boost::string_ref const& key)> key_sink_t;
+    // Feeds every key to the sink
+    typedef std::function<void (key_sink_t const& sink)> key_source_t;
+    // Builds the trie bottom-up from keys in ascending byte order in a single
+    // pass, duplicates are skipped. The trie has to be empty. Partitions must
+    // be ascending and no two may share a first byte, they are built in
+    // parallel into separate parts if an executor is given.
+    void bulk_load(std::vector<key_source_t> const& partitions,
+            indexer::executor* exec = nullptr);
+    bool empty() const;
+    // Stop after limit results and return whether they were cut
+    bool search(boost::string_ref const& data, size_t k, bool has_transp, results_t& results,
+            size_t limit = std::numeric_limits<size_t>::max());
+    bool search_split(boost::string_ref const& data, size_t switch_len,
             size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
-            bool has_transp, results_t& results);
+            bool has_transp, results_t& results,
+            size_t limit = std::numeric_limits<size_t>::max());
     void search_exact(boost::string_ref const& data, results_t& results);
+
+    // Same searches reporting leaves to a visitor, keys are not copied
+    bool search(boost::string_ref const& data, size_t k, bool has_transp,
+            leaf_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+    bool search_split(boost::string_ref const& data, size_t switch_len,
+            size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+            bool has_transp, leaf_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+    void search_exact(boost::string_ref const& data, leaf_visitor_t const& visitor);
+    // Reports keys starting with prefix in byte order
+    bool search_prefix(boost::string_ref const& prefix, leaf_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+    // Reports matches within k closest first, stops once limit are
+    // reported and every match at the distance of the last one is
+    bool search_closest(boost::string_ref const& data, size_t k, bool has_transp,
+            ranked_visitor_t const& visitor,
+            size_t limit = std::numeric_limits<size_t>::max());
+
+    // Counters since the trie was opened, safe to read during inserts
+    struct stats_t
+    {
+        stats_t();
+
+        uint64_t keys_inserted;
+        uint64_t node_splits;
+        uint64_t part_switches;
+        uint64_t parts;
+        uint64_t bytes_mapped;
+    };
+    stats_t stats() const;
+
+    // Gets a key without EOS
+    typedef std::function<uint32_t (boost::string_ref const& key)> weight_fn_t;
+    // Writes a compact read-only image of the trie, see frozen_trie. Keys
+    // are weighted for frozen_trie::search_top if a weight is given.
+    void freeze(boost::filesystem::path const& image, weight_fn_t const& weight = weight_fn_t());
 };
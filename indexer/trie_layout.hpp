@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstring>
+
 #include <boost/utility/string_ref.hpp>
 #include <boost/operators.hpp>
 #include <boost/variant.hpp>
@@ -48,6 +50,7 @@ struct trie_node
 {
     trie_node(segment_manager* mgr)
         : children(make_allocator<child>(mgr))
+        , first_bytes(make_allocator<char>(mgr))
     {}
 
     struct child
@@ -73,6 +76,25 @@ struct trie_node
     };
     cont::vector<child, ipc::allocator<child, 
         ipc::managed_mapped_file::segment_manager>> children;
+    // First label bytes of children, in the same order. Siblings never
+    // share a first byte, so a child is found with a single memchr.
+    string first_bytes;
+
+    // Must be called after every change of children
+    void reindex()
+    {
+        first_bytes.resize(children.size());
+        for (size_t i = 0; i < children.size(); ++i)
+            first_bytes[i] = children[i].label[0];
+    }
+
+    child* find_child(char c)
+    {
+        void const* pos = std::memchr(first_bytes.data(), c, first_bytes.size());
+        if (!pos)
+            return nullptr;
+        return &children[static_cast<char const*>(pos) - first_bytes.data()];
+    }
 };
 
 struct part_root
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+#include <cstdint>
+#include <functional>
+
+// Compact handle of a trie leaf, valid until the trie is modified. Live
+// tries pack the part, node offset and child index, frozen images use the
+// offset of the leaf's edge.
+typedef uint64_t leaf_id;
+
+// Gets every match of a search with its key without EOS, the key is only
+// valid during the call. Returning false stops the search.
+typedef std::function<bool (leaf_id leaf, boost::string_ref const& key)> leaf_visitor_t;
+
+// Same for searches ranking keys by the weights given to trie::freeze
+typedef std::function<bool (leaf_id leaf, boost::string_ref const& key, uint32_t weight)>
+    weighted_visitor_t;
+
+// Same for searches reporting the closest matches first with their distance
+typedef std::function<bool (leaf_id leaf, boost::string_ref const& key, size_t distance)>
+    ranked_visitor_t;
@@ -0,0 +1,723 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "fuzzy_processor.hpp"
+#include "fixed_fuzzy_processor.hpp"
+#include "trie_leaf.hpp"
+
+// Search algorithms shared by the mutable trie and its frozen image.
+//
+// Tree is an adaptor over a concrete node layout and has to provide:
+//     typedef ... node_ref;    // cheap handle to a node
+//     typedef ... child;       // element of a node's children range
+//     node_ref root();
+//     <range of child const&> children(node_ref const&);
+//     string_ref label(child const&);
+//     bool is_leaf(child const&);
+//     node_ref resolve(node_ref const& parent, child const&);
+//     child const* find_child(node_ref const&, char first_byte);  // nullptr if none
+//     leaf_id leaf(node_ref const& parent, child const&);
+// and for search_top also
+//     uint32_t weight(child const&);  // of the leaf, the largest below otherwise
+//
+// Matches are reported to a visitor with their leaf and key, a walk stops
+// once it has reported limit of them. Children are visited in label order
+// so the matches found are deterministic.
+
+// 0xFF is chosen because will never be in a valid UTF-8 string
+static const char trie_eos = '\xFF';
+
+template <typename RangeT>
+boost::string_ref as_ref(RangeT const& range)
+{
+    return boost::string_ref(::boost::begin(range), ::boost::size(range));
+}
+
+template<typename Range1T, typename Range2T, typename PredicateT>
+    inline boost::iterator_range<typename boost::range_const_iterator<Range1T>::type> common_prefix(
+    const Range1T& Input,
+    const Range2T& Test,
+    PredicateT Comp)
+{
+    typedef typename
+        ::boost::range_const_iterator<Range1T>::type Iterator1T;
+    typedef typename
+        ::boost::range_const_iterator<Range2T>::type Iterator2T;
+
+    ::boost::iterator_range<Iterator1T> lit_input(::boost::as_literal(Input));
+    ::boost::iterator_range<Iterator2T> lit_test(::boost::as_literal(Test));
+
+    Iterator1T InputEnd=::boost::end(lit_input);
+    Iterator2T TestEnd=::boost::end(lit_test);
+
+    Iterator1T it=::boost::begin(lit_input);
+    Iterator2T pit=::boost::begin(lit_test);
+    for(;
+        it!=InputEnd && pit!=TestEnd;
+        ++it,++pit)
+    {
+        if(!(Comp(*it,*pit)))
+            break;
+    }
+    return ::boost::iterator_range<Iterator1T>(::boost::begin(lit_input), it);
+}
+
+template<typename Range1T, typename Range2T>
+    inline boost::iterator_range<typename boost::range_const_iterator<Range1T>::type> common_prefix(
+    const Range1T& Input,
+    const Range2T& Test)
+{
+    return common_prefix(Input, Test, boost::is_equal());
+}
+
+template<typename Range1T, typename Range2T>
+    inline size_t common_prefix_length(
+    const Range1T& Input,
+    const Range2T& Test)
+{
+    return boost::size(common_prefix(Input, Test));
+}
+
+template <typename Tree>
+struct trie_searcher
+{
+    typedef typename Tree::node_ref node_ref;
+    typedef typename Tree::child child_t;
+    typedef std::vector<std::string> results_t;
+    typedef boost::string_ref string_ref;
+
+    trie_searcher(Tree& tree, size_t limit = std::numeric_limits<size_t>::max())
+        : tree(tree), limit(limit), found(0), stopped(false), truncated_(false)
+        , visitor(nullptr)
+    {}
+
+    // Whether the last search stopped at the limit
+    bool truncated() const
+    { return truncated_; }
+
+    void search_exact(string_ref const& data, results_t& results)
+    {
+        search_exact(data, collect(results));
+    }
+
+    void search(string_ref const& data, size_t k, bool has_transp, results_t& results)
+    {
+        search(data, k, has_transp, collect(results));
+    }
+
+    void search_split(string_ref const& data, size_t switch_len,
+            size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+            bool has_transp, results_t& results)
+    {
+        search_split(data, switch_len, k1, exact_dist1, k2, exact_dist2, has_transp,
+                collect(results));
+    }
+
+    void search_exact(string_ref const& data, leaf_visitor_t const& on_leaf)
+    {
+        start(on_leaf);
+        std::string pattern = append_eos(data);
+        do_search_exact(tree.root(), pattern, 0);
+    }
+
+    void search(string_ref const& data, size_t k, bool has_transp,
+            leaf_visitor_t const& on_leaf)
+    {
+        if (k == 0) {
+            search_exact(data, on_leaf);
+            return;
+        }
+        start(on_leaf);
+
+        std::string pattern = append_eos(data);
+        if (fixed_fuzzy_processor<1>::supports(pattern.size(), k))
+            fuzzy_search<fixed_fuzzy_processor<1>>(pattern, k, has_transp);
+        else if (fixed_fuzzy_processor<2>::supports(pattern.size(), k))
+            fuzzy_search<fixed_fuzzy_processor<2>>(pattern, k, has_transp);
+        else
+            fuzzy_search<fuzzy_processor>(pattern, k, has_transp);
+    }
+
+    void search_split(string_ref const& data, size_t switch_len,
+            size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+            bool has_transp, leaf_visitor_t const& on_leaf)
+    {
+        if (k1 == 0 && k2 == 0) {
+            search_exact(data, on_leaf);
+            return;
+        }
+        if (switch_len == 0) {
+            search(data, k1 + k2, has_transp, on_leaf);
+            return;
+        }
+        start(on_leaf);
+
+        std::string pattern = append_eos(data);
+        // Both halves share the processor type, pick the one fitting the longer one
+        size_t size = std::max(switch_len, pattern.size() - switch_len);
+        size_t k = std::max(k1, k2);
+        if (fixed_fuzzy_processor<1>::supports(size, k))
+            fuzzy_search_split<fixed_fuzzy_processor<1>>(pattern, switch_len,
+                    k1, exact_dist1, k2, exact_dist2, has_transp);
+        else if (fixed_fuzzy_processor<2>::supports(size, k))
+            fuzzy_search_split<fixed_fuzzy_processor<2>>(pattern, switch_len,
+                    k1, exact_dist1, k2, exact_dist2, has_transp);
+        else
+            fuzzy_search_split<fuzzy_processor>(pattern, switch_len,
+                    k1, exact_dist1, k2, exact_dist2, has_transp);
+    }
+
+    // Reports every key starting with prefix
+    void search_prefix(string_ref const& prefix, leaf_visitor_t const& on_leaf)
+    {
+        start(on_leaf);
+        node_ref parent = tree.root();
+        child_t const* edge = nullptr;
+        std::string scrap;
+        if (!find_prefix(prefix, parent, edge, scrap))
+            return;
+        if (!edge)
+            do_search_all(parent, scrap);
+        else if (tree.is_leaf(*edge))
+            report(parent, *edge, scrap);
+        else
+            do_search_all(tree.resolve(parent, *edge), scrap);
+    }
+
+    // Reports the keys starting with prefix heaviest first, up to limit of
+    // them. Subtrees lighter than the keys reported are never entered.
+    void search_top(string_ref const& prefix, weighted_visitor_t const& on_leaf)
+    {
+        found = 0;
+        stopped = false;
+        truncated_ = false;
+
+        node_ref parent = tree.root();
+        child_t const* edge = nullptr;
+        std::string base;
+        if (!find_prefix(prefix, parent, edge, base))
+            return;
+
+        // Keys are rebuilt from the chain of edges leading to a leaf
+        struct step
+        {
+            size_t prev;
+            node_ref parent;
+            child_t const* edge;
+        };
+        static const size_t NONE = std::numeric_limits<size_t>::max();
+        std::vector<step> steps;
+        // Heaviest first, ties in the order they were found
+        typedef std::pair<uint32_t, size_t> entry;
+        auto lighter = [](entry const& a, entry const& b) {
+            return a.first < b.first || (a.first == b.first && a.second > b.second);
+        };
+        std::priority_queue<entry, std::vector<entry>, decltype(lighter)> queue(lighter);
+        auto push = [&](size_t prev, node_ref const& from, child_t const& to) {
+            steps.push_back(step{ prev, from, &to });
+            queue.push(entry(tree.weight(to), steps.size() - 1));
+        };
+
+        if (edge) {
+            base.resize(base.size() - tree.label(*edge).size());
+            push(NONE, parent, *edge);
+        } else {
+            for (child_t const& child : tree.children(parent))
+                push(NONE, parent, child);
+        }
+
+        std::vector<size_t> chain;
+        std::string key;
+        while (!queue.empty() && !full()) {
+            entry top = queue.top();
+            queue.pop();
+            step const& s = steps[top.second];
+            if (!tree.is_leaf(*s.edge)) {
+                node_ref node = tree.resolve(s.parent, *s.edge);
+                for (child_t const& child : tree.children(node))
+                    push(top.second, node, child);
+                continue;
+            }
+
+            chain.clear();
+            for (size_t i = top.second; i != NONE; i = steps[i].prev)
+                chain.push_back(i);
+            key = base;
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                string_ref label = tree.label(*steps[*it].edge);
+                key.append(label.begin(), label.end());
+            }
+            ++found;
+            // EOS hack :(
+            if (!on_leaf(tree.leaf(s.parent, *s.edge), string_ref(key).substr(0, key.size() - 1),
+                        top.first))
+                stopped = true;
+        }
+    }
+
+    // Reports the matches within k closest first, those at the same distance
+    // in no particular order. Nodes are expanded in the order of the
+    // smallest distance a key below them can have, so once limit matches
+    // are reported the walk stops with the last distance they reached:
+    // every match that close is reported, no farther node is entered.
+    void search_closest(string_ref const& data, size_t k, bool has_transp,
+            ranked_visitor_t const& on_leaf)
+    {
+        found = 0;
+        stopped = false;
+        truncated_ = false;
+
+        std::string pattern = append_eos(data);
+        if (fixed_fuzzy_processor<1>::supports(pattern.size(), k))
+            closest_search<fixed_fuzzy_processor<1>>(pattern, k, has_transp, on_leaf);
+        else if (fixed_fuzzy_processor<2>::supports(pattern.size(), k))
+            closest_search<fixed_fuzzy_processor<2>>(pattern, k, has_transp, on_leaf);
+        else
+            ranked_search(pattern, k, has_transp, on_leaf);
+    }
+
+private:
+    static leaf_visitor_t collect(results_t& results)
+    {
+        return [&results](leaf_id, string_ref const& key) {
+            results.push_back(std::string(key));
+            return true;
+        };
+    }
+
+    void start(leaf_visitor_t const& on_leaf)
+    {
+        visitor = &on_leaf;
+        found = 0;
+        stopped = false;
+        truncated_ = false;
+    }
+
+    bool full()
+    {
+        if (stopped)
+            return true;
+        if (found < limit)
+            return false;
+        truncated_ = true;
+        return true;
+    }
+
+    void report(node_ref const& parent, child_t const& leaf, string_ref const& s)
+    {
+        ++found;
+        // EOS hack :(
+        if (!(*visitor)(tree.leaf(parent, leaf), s.substr(0, s.size() - 1)))
+            stopped = true;
+    }
+
+    // Finds the edge all keys starting with prefix are below, none for an
+    // empty prefix. scrap gets the key bytes up to the end of that edge.
+    bool find_prefix(string_ref prefix, node_ref& parent, child_t const*& edge,
+            std::string& scrap)
+    {
+        while (!prefix.empty()) {
+            if (edge) {
+                if (tree.is_leaf(*edge))
+                    return false;
+                parent = tree.resolve(parent, *edge);
+            }
+            edge = tree.find_child(parent, prefix[0]);
+            if (!edge)
+                return false;
+            string_ref label = tree.label(*edge);
+            size_t len = common_prefix_length(label, prefix);
+            if (len < std::min(label.size(), prefix.size()))
+                return false;
+            scrap.append(label.begin(), label.end());
+            prefix.remove_prefix(len);
+        }
+        return true;
+    }
+
+    void do_search_all(node_ref const& ref, std::string& scrap)
+    {
+        for (child_t const& child : tree.children(ref)) {
+            if (full())
+                return;
+            string_ref label = tree.label(child);
+            scrap.append(label.begin(), label.end());
+            if (tree.is_leaf(child))
+                report(ref, child, scrap);
+            else
+                do_search_all(tree.resolve(ref, child), scrap);
+            scrap.resize(scrap.size() - label.size());
+        }
+    }
+
+    // Contexts of the fixed processors are plain values, so the frontier
+    // can keep one for every node it holds
+    template <typename Proc>
+    void closest_search(std::string const& pattern, size_t k, bool has_transp,
+            ranked_visitor_t const& on_leaf)
+    {
+        Proc proc(pattern, k, has_transp);
+
+        // Keys are rebuilt from the chain of edges leading to a leaf
+        struct step
+        {
+            size_t prev;
+            node_ref parent;
+            child_t const* edge;
+        };
+        struct entry
+        {
+            size_t step;
+            typename Proc::context ctx;
+        };
+        static const size_t NONE = std::numeric_limits<size_t>::max();
+        std::vector<step> steps;
+        // Nodes and leaves by their distance, nodes of a bucket are walked
+        // depth first
+        std::vector<std::vector<entry>> nodes(k + 1);
+        std::vector<std::vector<size_t>> leaves(k + 1);
+
+        std::vector<size_t> chain;
+        std::string key;
+        auto report_step = [&](size_t idx, size_t dist) {
+            chain.clear();
+            for (size_t i = idx; i != NONE; i = steps[i].prev)
+                chain.push_back(i);
+            key.clear();
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                string_ref label = tree.label(*steps[*it].edge);
+                key.append(label.begin(), label.end());
+            }
+            ++found;
+            step const& s = steps[idx];
+            // EOS hack :(
+            if (!on_leaf(tree.leaf(s.parent, *s.edge), string_ref(key).substr(0, key.size() - 1),
+                        dist))
+                stopped = true;
+        };
+
+        size_t current = 0;
+        auto expand = [&](size_t prev, node_ref const& node, typename Proc::context const& ctx) {
+            for (child_t const& child : tree.children(node)) {
+                if (stopped)
+                    return;
+                typename Proc::context new_ctx = proc.fork(ctx);
+                for (char c : tree.label(child))
+                    proc.feed(c, new_ctx);
+                bool final = false;
+                size_t dist = 0;
+                bool alive = proc.query(new_ctx, final, &dist);
+                if (tree.is_leaf(child)) {
+                    if (!final)
+                        continue;
+                    steps.push_back(step{ prev, node, &child });
+                    if (dist <= current)
+                        report_step(steps.size() - 1, current);
+                    else
+                        leaves[dist].push_back(steps.size() - 1);
+                } else if (alive) {
+                    steps.push_back(step{ prev, node, &child });
+                    size_t bound = std::max(current, proc.min_distance(new_ctx));
+                    nodes[bound].push_back(entry{ steps.size() - 1, new_ctx });
+                }
+            }
+        };
+
+        expand(NONE, tree.root(), typename Proc::context(proc));
+        for (; current <= k && !stopped; ++current) {
+            if (found >= limit) {
+                for (size_t d = current; d <= k && !truncated_; ++d)
+                    truncated_ = !nodes[d].empty() || !leaves[d].empty();
+                return;
+            }
+            for (size_t idx : leaves[current]) {
+                if (stopped)
+                    return;
+                report_step(idx, current);
+            }
+            std::vector<entry>& bucket = nodes[current];
+            while (!bucket.empty() && !stopped) {
+                entry e = bucket.back();
+                bucket.pop_back();
+                step const& s = steps[e.step];
+                expand(e.step, tree.resolve(s.parent, *s.edge), e.ctx);
+            }
+        }
+    }
+
+    // The generic processor keeps its contexts on a stack, its matches are
+    // ranked after a full walk
+    void ranked_search(std::string const& pattern, size_t k, bool has_transp,
+            ranked_visitor_t const& on_leaf)
+    {
+        struct ranked
+        {
+            size_t distance;
+            std::string key;
+            leaf_id leaf;
+        };
+        std::vector<ranked> matches;
+        fuzzy_processor proc(pattern, k, has_transp);
+        size_t saved_limit = limit;
+        limit = std::numeric_limits<size_t>::max();
+        search(string_ref(pattern).substr(0, pattern.size() - 1), k, has_transp,
+                [&](leaf_id leaf, string_ref const& key) {
+                    std::string s(key.begin(), key.end());
+                    s += trie_eos;
+                    size_t dist = k;
+                    proc.check(s, true, &dist);
+                    s.pop_back();
+                    matches.push_back(ranked{ dist, std::move(s), leaf });
+                    return true;
+                });
+        limit = saved_limit;
+        std::stable_sort(matches.begin(), matches.end(), [](ranked const& a, ranked const& b) {
+            return a.distance < b.distance;
+        });
+        found = 0;
+        stopped = false;
+        for (size_t i = 0; i < matches.size(); ++i) {
+            if (i > 0 && found >= limit && matches[i].distance > matches[i - 1].distance) {
+                truncated_ = true;
+                return;
+            }
+            ++found;
+            if (!on_leaf(matches[i].leaf, matches[i].key, matches[i].distance))
+                return;
+        }
+    }
+
+    template <typename Proc>
+    void fuzzy_search(std::string const& pattern, size_t k, bool has_transp)
+    {
+        Proc proc(pattern, k, has_transp);
+        typename Proc::context ctx(proc);
+
+        std::string scrap;
+        do_search(tree.root(), scrap, proc, ctx, false);
+    }
+
+    template <typename Proc>
+    void fuzzy_search_split(std::string const& pattern, size_t switch_len,
+            size_t k1, bool exact_dist1, size_t k2, bool exact_dist2,
+            bool has_transp)
+    {
+        string_ref s1 = string_ref(pattern).substr(0, switch_len);
+        string_ref s2 = string_ref(pattern).substr(switch_len);
+
+        Proc proc1(s1, k1, has_transp);
+        Proc proc2(s2, k2, has_transp);
+        typename Proc::context ctx1(proc1);
+        typename Proc::context ctx2(proc2);
+
+        node_ref root = tree.root();
+        std::string scrap;
+        if (k1 != 0) {
+            // It is possible that s1 matches an empty string.
+            if (s1.size() == k1 || (!exact_dist1 && s1.size() < k1)) {
+                do_search(root, scrap, proc2, ctx2, exact_dist2);
+            }
+            do_search2(root, scrap, switch_len, proc1, ctx1, exact_dist1,
+                    proc2, ctx2, exact_dist2);
+        } else {
+            do_search_semiexact(root, scrap, pattern, switch_len,
+                    proc2, ctx2, exact_dist2);
+        }
+    }
+
+    void do_search_exact(node_ref const& ref, string_ref const& full_str, size_t start_pos)
+    {
+        // Keys end with EOS, so the pattern ends inside a label
+        string_ref s = full_str.substr(start_pos);
+        assert(!s.empty());
+
+        // Find the child with the longest matching prefix
+        size_t maxlen;
+        child_t const* match;
+        std::tie(match, maxlen) = find_longest_match(ref, s);
+
+        if (maxlen == 0 || maxlen < tree.label(*match).size()) {
+            return;
+        }
+
+        string_ref rest = s.substr(maxlen);
+
+        if (rest.empty()) {
+            report(ref, *match, full_str);
+            return;
+        } else if (!tree.is_leaf(*match)) {
+            do_search_exact(tree.resolve(ref, *match), full_str, start_pos + maxlen);
+        }
+    }
+
+    template <typename Proc>
+    void do_search(node_ref const& ref, std::string& scrap, Proc const& proc,
+            typename Proc::context const& ctx, bool exact_dist, size_t skip_prefix = 0)
+    {
+        for (child_t const& child : tree.children(ref)) {
+            if (full())
+                return;
+            typename Proc::context new_ctx = proc.fork(ctx);
+            string_ref label = tree.label(child);
+            scrap.append(label.begin(), label.end());
+
+            bool is_leaf = tree.is_leaf(child);
+
+            size_t dist;
+            string_ref s(scrap);
+            s.remove_prefix(skip_prefix);
+            if (proc.check(s, is_leaf, &dist, &new_ctx)) {
+                if (!is_leaf) {
+                    do_search(tree.resolve(ref, child), scrap, proc, new_ctx, exact_dist,
+                            skip_prefix);
+                } else if (!exact_dist || dist == proc.max_corrections()) {
+                    report(ref, child, scrap);
+                }
+            }
+
+            scrap.resize(scrap.size() - label.size());
+        }
+    }
+
+    template <typename Proc>
+    void do_search_semiexact(node_ref const& ref, std::string& scrap,
+            string_ref const& str, size_t switch_len,
+            Proc const& proc, typename Proc::context const& ctx, bool exact_dist)
+    {
+        // scrap is shorter than switch_len here, so at least the first byte
+        // has to match exactly and only one child can do it
+        assert(scrap.size() < switch_len);
+        child_t const* match = tree.find_child(ref, str[0]);
+        if (!match || full())
+            return;
+        child_t const& child = *match;
+
+        string_ref label = tree.label(child);
+        scrap.append(label.begin(), label.end());
+        size_t step = label.size();
+
+        bool is_leaf = tree.is_leaf(child);
+
+        size_t prefix = switch_len + step - scrap.size();
+        if (scrap.size() < switch_len) {
+            if (!is_leaf && str.substr(0, step) == label) {
+                do_search_semiexact(tree.resolve(ref, child), scrap, str.substr(step),
+                        switch_len, proc, ctx, exact_dist);
+            }
+        } else if (str.substr(0, prefix) == label.substr(0, prefix)) {
+            typename Proc::context new_ctx = proc.fork(ctx);
+            if (scrap.size() > switch_len) {
+                size_t dist;
+                if (proc.check(label.substr(prefix), is_leaf, &dist, &new_ctx)) {
+                    if (!is_leaf) {
+                        do_search(tree.resolve(ref, child), scrap, proc, new_ctx,
+                                exact_dist, switch_len);
+                    } else if (!exact_dist || dist == proc.max_corrections()) {
+                        report(ref, child, scrap);
+                    }
+                }
+            } else if (!is_leaf) {
+                do_search(tree.resolve(ref, child), scrap, proc, new_ctx, exact_dist,
+                        switch_len);
+            }
+        }
+
+        scrap.resize(scrap.size() - step);
+    }
+
+    template <typename Proc>
+    void do_search2(node_ref const& ref, std::string& scrap, size_t switch_len,
+            Proc const& proc1, typename Proc::context const& ctx1,
+            bool exact_dist1, Proc const& proc2,
+            typename Proc::context const& ctx2, bool exact_dist2)
+    {
+        for (child_t const& child : tree.children(ref)) {
+            if (full())
+                return;
+            typename Proc::context new_ctx1 = proc1.fork(ctx1);
+            size_t start_pos = scrap.size();
+            string_ref label = tree.label(child);
+            scrap.append(label.begin(), label.end());
+
+            bool is_leaf = tree.is_leaf(child);
+
+            const size_t gap = proc1.max_corrections();
+            for (; start_pos < scrap.size(); ++start_pos) {
+                if (start_pos + 1 > switch_len + gap) {
+                    break;
+                }
+                proc1.feed(scrap, new_ctx1);
+                bool final_state = false;
+                if (!proc1.query(new_ctx1, final_state)) {
+                    break;
+                }
+                if (start_pos + 1 < switch_len - gap) {
+                    continue;
+                }
+                if (final_state) {
+                    typename Proc::context new_ctx2 = proc2.fork(ctx2);
+                    bool ok2 = true, final2 = false;
+                    size_t dist2;
+                    for (size_t k = start_pos + 1; k < scrap.size(); ++k) {
+                        proc2.feed(scrap[k], new_ctx2);
+                        if (!proc2.query(new_ctx2, final2, &dist2)) {
+                            ok2 = false;
+                            break;
+                        }
+                    }
+                    if (start_pos + 1 == scrap.size() || ok2) {
+                        if (!is_leaf) {
+                            do_search(tree.resolve(ref, child), scrap, proc2, new_ctx2,
+                                    exact_dist2, start_pos + 1);
+                        } else if (final2 &&
+                                (!exact_dist2 || dist2 == proc2.max_corrections())) {
+                            report(ref, child, scrap);
+                        }
+                    }
+                }
+            }
+
+            if (!is_leaf && start_pos == scrap.size()) {
+                do_search2(tree.resolve(ref, child), scrap, switch_len,
+                        proc1, new_ctx1, exact_dist1, proc2, ctx2, exact_dist2);
+            }
+
+            scrap.resize(scrap.size() - label.size());
+        }
+    }
+
+    std::pair<child_t const*, size_t> find_longest_match(node_ref const& ref, string_ref const& s)
+    {
+        child_t const* match = tree.find_child(ref, s[0]);
+        if (!match)
+            return std::make_pair(nullptr, 0);
+        return std::make_pair(match, common_prefix_length(tree.label(*match), s));
+    }
+
+    static std::string append_eos(string_ref const& s)
+    {
+        std::string str;
+        str.reserve(s.size() + 1);
+        str.append(s.begin(), s.end());
+        str += trie_eos;
+        return str;
+    }
+
+    Tree& tree;
+    size_t limit;
+    size_t found;
+    bool stopped;
+    bool truncated_;
+    leaf_visitor_t const* visitor;
+};
@@ -4,13 +4,14 @@
 #include <sstream>
 #include <mongo/client/dbclient.h>
 #include <unordered_map>
+#include <algorithm>
 
 #include "exceptions.hpp"
 
 using boost::string_ref;
 
 template <>
-struct pimpl<indexer::value_db>::implementation
+struct pimpl<indexer::mongo_value_db>::implementation
 {
     implementation(string_ref const& url)
     {
@@ -32,9 +33,9 @@ struct pimpl<indexer::value_db>::implementation
 };
 
 template <>
-struct pimpl<indexer::value_db::transaction>::implementation
+struct pimpl<indexer::mongo_value_db::transaction>::implementation
 {
-    typedef std::unordered_map<std::string, 
+    typedef std::unordered_map<indexer::term_id,
             std::unique_ptr<mongo::BSONObjBuilder>> objects_t;
     objects_t objects;
     std::unique_ptr<mongo::ScopedDbConnection> connection;
@@ -43,12 +44,21 @@ struct pimpl<indexer::value_db::transaction>::implementation
 
 namespace indexer {
 
+std::vector<std::string> value_db::multi_get(std::vector<term_id> const& keys) const
+{
+    std::vector<std::string> result;
+    result.reserve(keys.size());
+    for (term_id key : keys)
+        result.push_back(get(key));
+    return result;
+}
+
 mongo::StringData as_str(string_ref const& x)
 {
     return mongo::StringData(x.data(), x.size());
 }
 
-value_db::value_db(string_ref const& server, string_ref const& ns)
+mongo_value_db::mongo_value_db(string_ref const& server, string_ref const& ns)
     : base(server)
 {
     implementation& impl = **this;
@@ -58,11 +68,25 @@ value_db::value_db(string_ref const& server, string_ref const& ns)
     conn->done();
 }
 
-std::string value_db::get(string_ref const& key) const
+void mongo_value_db::drop(string_ref const& server, string_ref const& ns)
+{
+    implementation impl(server);
+    auto conn = impl.connection();
+    conn->get()->dropCollection(std::string(ns));
+    conn->done();
+}
+
+// IDs are stored as int, the full uint32 range round trips through it
+int as_int(term_id key)
+{
+    return static_cast<int>(key);
+}
+
+std::string mongo_value_db::get(term_id key) const
 {
     implementation const& impl = **this;
     auto conn = impl.connection();
-    auto cursor = conn->get()->query(impl.ns, QUERY("key" << as_str(key)));
+    auto cursor = conn->get()->query(impl.ns, QUERY("key" << as_int(key)));
     std::ostringstream oss;
     while (cursor->more()) {
         auto const& obj = cursor->next();
@@ -74,32 +98,66 @@ std::string value_db::get(string_ref const& key) const
     return oss.str();
 }
 
-std::unique_ptr<value_db::transaction> value_db::start_tx()
+std::vector<std::string> mongo_value_db::multi_get(std::vector<term_id> const& keys) const
+{
+    // Keeps $in queries well below the BSON document size limit
+    static const size_t BATCH_SIZE = 1000;
+
+    implementation const& impl = **this;
+    std::vector<std::string> result(keys.size());
+    std::unordered_multimap<term_id, size_t> positions;
+    for (size_t i = 0; i < keys.size(); ++i)
+        positions.emplace(keys[i], i);
+
+    auto conn = impl.connection();
+    for (size_t start = 0; start < keys.size(); start += BATCH_SIZE) {
+        mongo::BSONArrayBuilder batch;
+        size_t end = std::min(keys.size(), start + BATCH_SIZE);
+        for (size_t i = start; i < end; ++i)
+            batch << as_int(keys[i]);
+        auto cursor = conn->get()->query(impl.ns,
+                QUERY("key" << BSON("$in" << batch.arr())));
+        while (cursor->more()) {
+            auto const& obj = cursor->next();
+            std::string value;
+            for (auto const& part : obj["values"].Array()) {
+                value += part.String();
+            }
+            auto range = positions.equal_range(static_cast<term_id>(obj["key"].Int()));
+            for (auto it = range.first; it != range.second; ++it) {
+                result[it->second] += value;
+            }
+        }
+    }
+    conn->done();
+    return result;
+}
+
+std::unique_ptr<value_db::transaction> mongo_value_db::start_tx()
 {
     implementation& impl = **this;
     std::unique_ptr<transaction> result(new transaction());
     (*result)->connection = impl.connection();
     (*result)->ns = &impl.ns;
-    return result;
+    return std::move(result);
 }
 
-value_db::transaction::transaction()
+mongo_value_db::transaction::transaction()
 {
 }
 
-value_db::transaction::~transaction()
+mongo_value_db::transaction::~transaction()
 {
 }
 
-void value_db::transaction::append(string_ref const& key, string_ref const& value)
+void mongo_value_db::transaction::append(term_id key, string_ref const& value)
 {
     implementation& impl = **this;
-    std::string key_s(key.begin(), key.end());
-    auto it = impl.objects.find(key_s);
+    auto it = impl.objects.find(key);
     if (it == impl.objects.end()) {
         typedef implementation::objects_t::mapped_type bptr_t;
-        it = impl.objects.emplace(key_s, bptr_t(new mongo::BSONObjBuilder())).first;
-        *it->second << mongo::GENOID << "key" << as_str(key);
+        it = impl.objects.emplace(key, bptr_t(new mongo::BSONObjBuilder())).first;
+        *it->second << mongo::GENOID << "key" << as_int(key);
         mongo::BSONArrayBuilder values(it->second->subarrayStart("values"));
         values << as_str(value);
     } else {
@@ -107,7 +165,7 @@ void value_db::transaction::append(string_ref const& key, string_ref const& valu
     }
 }
 
-void value_db::transaction::commit()
+void mongo_value_db::transaction::commit()
 {
     implementation& impl = **this;
     for (auto const& p : impl.objects) {
@@ -117,7 +175,7 @@ void value_db::transaction::commit()
     impl.connection->done();
 }
 
-void value_db::transaction::rollback()
+void mongo_value_db::transaction::rollback()
 {
     implementation& impl = **this;
     impl.objects.clear();
@@ -3,33 +3,61 @@
 #include "pimpl/pimpl.h"
 #include <boost/noncopyable.hpp>
 #include <boost/utility/string_ref.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "term_dict.hpp"
 
 namespace indexer {
 
+// Postings storage keyed by term ID, values appended to a term are concatenated
 struct value_db
-    : private pimpl<value_db>::pointer_semantics
-    , public boost::noncopyable
+    : public boost::noncopyable
+{
+    struct transaction
+        : public boost::noncopyable
+    {
+        virtual ~transaction() {}
+        virtual void append(term_id key, boost::string_ref const& data) = 0;
+        virtual void rollback() = 0;
+        virtual void commit() = 0;
+    };
+
+    virtual ~value_db() {}
+
+    virtual std::string get(term_id key) const = 0;
+    // Values are returned in the order of keys, empty for missing keys
+    virtual std::vector<std::string> multi_get(std::vector<term_id> const& keys) const;
+    virtual std::unique_ptr<transaction> start_tx() = 0;
+};
+
+struct mongo_value_db
+    : public value_db
+    , private pimpl<mongo_value_db>::pointer_semantics
 {
     struct transaction
-        : private pimpl<transaction>::pointer_semantics
-        , public boost::noncopyable
+        : public value_db::transaction
+        , private pimpl<transaction>::pointer_semantics
     {
     private:
-        friend class value_db;
+        friend struct mongo_value_db;
         transaction();
 
     public:
-        transaction(transaction&&) = default;
         ~transaction();
-        void append(boost::string_ref const& key, boost::string_ref const& data);
+        void append(term_id key, boost::string_ref const& data);
         void rollback();
         void commit();
     };
 
-    value_db(boost::string_ref const& server, boost::string_ref const& ns);
+    mongo_value_db(boost::string_ref const& server, boost::string_ref const& ns);
+    // Removes the collection with all its values
+    static void drop(boost::string_ref const& server, boost::string_ref const& ns);
 
-    std::string get(boost::string_ref const& key) const;
-    std::unique_ptr<transaction> start_tx();
+    std::string get(term_id key) const;
+    std::vector<std::string> multi_get(std::vector<term_id> const& keys) const;
+    std::unique_ptr<value_db::transaction> start_tx();
 };
 
 }
@@ -8,7 +8,7 @@ from collections import Counter, defaultdict
 import cPickle
 from pymongo import MongoClient
 import rpcz
-from time import time
+from time import sleep, time
 
 from extract import unwiki
 import index_server_pb2 as index_pb
@@ -48,6 +48,22 @@ if not args.disable_index:
         store.overwrite = False
         iserver.openStore(store, deadline_ms=1)
 
+    # Batches the server can still queue, refreshed from getProgress once used up
+    feed_credit = [0]
+
+    def feed(bdata):
+        bdata.pipelined = True
+        while feed_credit[0] <= 0:
+            progress = iserver.getProgress(index_pb.Void(), deadline_ms=10)
+            if progress.failed_batches:
+                raise RuntimeError('Index server failed to apply {0} batches: {1}'.format(
+                    progress.failed_batches, progress.last_error))
+            feed_credit[0] = progress.queue_capacity - progress.queued_batches
+            if feed_credit[0] <= 0:
+                sleep(0.01)
+        feed_credit[0] -= 1
+        iserver.feedData(bdata, deadline_ms=10)
+
 
 ##
 # Initialising MongoDB
@@ -153,7 +169,7 @@ try:
 
             # Index
             if not args.disable_index:
-                iserver.feedData(bdata, deadline_ms=10)
+                feed(bdata)
 
             t3 = time()
 
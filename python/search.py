@@ -33,46 +33,68 @@ class IndexServer(object):
           except rpcz.RpcDeadlineExceeded:
             self.iserver.useStore(store, deadline_ms=5)
 
-    def query(self, query_word, max_mistakes=0, timeout=3, keys_only=False):
+    def query(self, query_word, max_mistakes=0, timeout=3, keys_only=False,
+              escalate=False, ranked=False):
+        """With ranked, matches come closest first with their corrections."""
         query = index_pb.WordQuery()
         query.options.Clear()
         query.options.keysOnly = keys_only
         query.word = query_word
         query.maxCorrections = max_mistakes
+        query.escalate = escalate
+        query.ranked = ranked
         return self.iserver.wordQuery(query, deadline_ms=timeout)
 
+    def batch_query(self, query_words, max_mistakes=0, timeout=3, keys_only=False):
+        """Searches every word with k raised from 0 until something is found."""
+        batch = index_pb.BatchQuery()
+        for word in query_words:
+            query = batch.queries.add()
+            query.options.Clear()
+            query.options.keysOnly = keys_only
+            query.word = word
+            query.maxCorrections = max_mistakes
+            query.escalate = True
+        return self.iserver.batchQuery(batch, deadline_ms=timeout).results
+
+    def complete(self, prefix, limit=10, timeout=3):
+        """Returns the heaviest keys starting with the prefix with their weights."""
+        query = index_pb.PrefixQuery()
+        query.options.limit = limit
+        query.options.keysOnly = True
+        query.prefix = prefix
+        result = self.iserver.prefixQuery(query, deadline_ms=timeout)
+        return [(rec.key, rec.weight) for rec in result.values]
+
 
 class Searcher(object):
-    def correct_token(self, token):
-        index = self.index
-        orig_token = token
-        token = token.lower()
-        if len(token) > 2 and has_char(token):
+    def correct_tokens(self, tokens):
+        lowered = [token.lower() for token in tokens]
+        candidates = [token for token in set(lowered)
+                      if len(token) > 2 and has_char(token)]
+        corrections = {}
+        if candidates:
             try:
                 self._TIME()
-                r = index.query(token, max_mistakes=0, keys_only=True)
+                results = self.index.batch_query(candidates, max_mistakes=2,
+                                                 timeout=10, keys_only=True)
                 self._TIME('index')
-                if r.exact_total == 0:
-                    try:
-                        self._TIME()
-                        r = index.query(token, max_mistakes=1, keys_only=True)
-                        self._TIME('index')
-                        if r.exact_total == 0:
-                            self._TIME()
-                            r = index.query(token, max_mistakes=2, keys_only=True)
-                            self._TIME('index')
-                        if 0 < r.exact_total <= 10:
-                            new = map(lambda rec: rec.key, r.values)
-                            self.corrected.append((orig_token, new))
-                            return new
-                        else:
-                            self.corrected.append((orig_token, None))
-                    except rpcz.RpcDeadlineExceeded:
-                        self.corrected.append((orig_token, None))
-                        raise
+                corrections = dict(zip(candidates, results))
             except rpcz.RpcDeadlineExceeded:
                 self.correct_deadline = True
-        return [token]
+
+        corrected = []
+        for orig_token, token in zip(tokens, lowered):
+            r = corrections.get(token)
+            if r is not None and r.corrections > 0:
+                if 0 < r.exact_total <= 10:
+                    new = map(lambda rec: rec.key, r.values)
+                    self.corrected.append((orig_token, new))
+                    corrected.append(new)
+                    continue
+                self.corrected.append((orig_token, None))
+            corrected.append([token])
+        return corrected
 
 
     def __init__(self, query, mongo_cred, server='tcp://localhost:5555', store_path='enwiki'):
@@ -91,7 +113,7 @@ class Searcher(object):
 
 
         self._TIME()
-        query_tokens = map(self.correct_token, tokens(query))
+        query_tokens = self.correct_tokens(list(tokens(query)))
 
         querysets = set([frozenset(normalise_drop(ts)) for ts in query_tokens])
         querysets = filter(lambda s: s, querysets)
@@ -108,19 +130,16 @@ class Searcher(object):
 
             for kw in queryset:
                 self._TIME()
+                # Exact matches, or those one correction away if there are none.
+                # Corrections are given up on a deadline, exact matches are retried.
                 try :
-                  res = index.query(kw, max_mistakes=0, timeout=3)
+                  res = index.query(kw, max_mistakes=1, timeout=3, escalate=True, ranked=True)
                 except rpcz.RpcDeadlineExceeded:
+                  self.extraquery_deadline = True
                   try:
                     res = index.query(kw, max_mistakes=0, timeout=4)
                   except rpcz.RpcDeadlineExceeded:
                     res = index.query(kw, max_mistakes=0, timeout=5)
-
-                if res.exact_total == 0:
-                    try:
-                        res = index.query(kw, max_mistakes=1, timeout=3)
-                    except rpcz.RpcDeadlineExceeded:
-                        self.extraquery_deadline = True
                 self._TIME('index')
 
                 for record in res.values: